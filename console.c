@@ -1,12 +1,17 @@
 /* Implementation of simple command-line interface */
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -20,6 +25,23 @@ int simulation = 0;
 int show_entropy = 0;
 static cmd_element_t *cmd_list = NULL;
 static param_element_t *param_list = NULL;
+
+/* Commands and parameters are also indexed by name for quick lookup, while
+ * the sorted lists serve for help and completion.  Open addressing with
+ * linear probing, kept at most half full.
+ */
+typedef struct {
+    const char *name;
+    void *ele;
+} hash_entry_t;
+
+typedef struct {
+    hash_entry_t *slots;
+    size_t capacity; /* Power of 2 */
+    size_t count;
+} hash_table_t;
+
+static hash_table_t cmd_table, param_table;
 static bool block_flag = false;
 static bool prompt_flag = true;
 
@@ -70,7 +92,146 @@ static void init_in();
 static bool push_file(char *fname);
 static void pop_file();
 
-static bool interpret_cmda(int argc, char *argv[]);
+static void run_block(const char *text, size_t size);
+
+typedef struct __journal journal_t;
+static journal_t *recording;
+static void journal_record(journal_t *j, int argc, char *argv[]);
+static journal_t *journal_open(const char *fname);
+static void journal_close(journal_t *j);
+static bool convert_trace(const char *src, const char *dst);
+static bool is_journal_fd(int fd);
+static void run_journal(int fd, const char *fname);
+
+/* FNV-1a hash of a name */
+static uint32_t hash_name(const char *name)
+{
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h ^= (unsigned char) *name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Find element by name.  Return NULL if absent */
+static void *hash_find(const hash_table_t *t, const char *name)
+{
+    if (!t->capacity)
+        return NULL;
+
+    size_t mask = t->capacity - 1;
+    for (size_t i = hash_name(name) & mask; t->slots[i].name;
+         i = (i + 1) & mask) {
+        if (!strcmp(t->slots[i].name, name))
+            return t->slots[i].ele;
+    }
+    return NULL;
+}
+
+/* Add element, replacing any element of the same name */
+static void hash_insert(hash_table_t *t, const char *name, void *ele)
+{
+    if (2 * (t->count + 1) > t->capacity) {
+        hash_table_t grown = {
+            .capacity = t->capacity ? 2 * t->capacity : 64,
+        };
+        grown.slots = calloc_or_fail(grown.capacity, sizeof(hash_entry_t),
+                                     "hash_insert");
+        for (size_t i = 0; i < t->capacity; i++) {
+            if (t->slots[i].name)
+                hash_insert(&grown, t->slots[i].name, t->slots[i].ele);
+        }
+        if (t->slots)
+            free_array(t->slots, t->capacity, sizeof(hash_entry_t));
+        *t = grown;
+    }
+
+    size_t mask = t->capacity - 1;
+    size_t i = hash_name(name) & mask;
+    while (t->slots[i].name && strcmp(t->slots[i].name, name))
+        i = (i + 1) & mask;
+    if (!t->slots[i].name) {
+        t->slots[i].name = name;
+        t->count++;
+    }
+    t->slots[i].ele = ele;
+}
+
+static void hash_free(hash_table_t *t)
+{
+    if (t->slots)
+        free_array(t->slots, t->capacity, sizeof(hash_entry_t));
+    t->slots = NULL;
+    t->capacity = t->count = 0;
+}
+
+/* Execution times of a command, in a log-bucketed histogram as in
+ * HdrHistogram: the range of each power of two is split into
+ * LATENCY_SUB buckets, so that any time is known to within 1/LATENCY_SUB
+ * of its value.  Times are in nanoseconds and capped at 2^LATENCY_EXP.
+ */
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+#define LATENCY_EXP 40
+#define LATENCY_BUCKETS ((LATENCY_EXP - LATENCY_SUB_BITS + 2) * LATENCY_SUB)
+
+typedef struct __latency {
+    uint64_t count;
+    int64_t total;
+    int64_t max;
+    uint64_t bucket[LATENCY_BUCKETS];
+} latency_t;
+
+static int latency_bucket(int64_t ns)
+{
+    if (ns < LATENCY_SUB)
+        return ns < 0 ? 0 : ns;
+    if (ns >= (int64_t) 1 << LATENCY_EXP)
+        ns = ((int64_t) 1 << LATENCY_EXP) - 1;
+    int exp = 63 - __builtin_clzll(ns);
+    int shift = exp - LATENCY_SUB_BITS;
+    return ((shift + 1) << LATENCY_SUB_BITS) + ((ns >> shift) - LATENCY_SUB);
+}
+
+/* Largest time falling into bucket */
+static int64_t latency_value(int bucket)
+{
+    if (bucket < LATENCY_SUB)
+        return bucket;
+    int shift = (bucket >> LATENCY_SUB_BITS) - 1;
+    int64_t sub = LATENCY_SUB + (bucket & (LATENCY_SUB - 1));
+    return ((sub + 1) << shift) - 1;
+}
+
+static void latency_record(cmd_element_t *cmd, int64_t ns)
+{
+    latency_t *l = cmd->latency;
+    if (!l) {
+        l = calloc_or_fail(1, sizeof(latency_t), "latency_record");
+        cmd->latency = l;
+    }
+    l->count++;
+    l->total += ns;
+    if (ns > l->max)
+        l->max = ns;
+    l->bucket[latency_bucket(ns)]++;
+}
+
+/* Time within which the given fraction of the executions completed */
+static int64_t latency_percentile(const latency_t *l, double fraction)
+{
+    /* Index of the execution in sorted order, counting from 0 */
+    uint64_t rank = (uint64_t) ceil(fraction * l->count);
+    rank = rank ? rank - 1 : 0;
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += l->bucket[i];
+        if (seen > rank)
+            return latency_value(i) < l->max ? latency_value(i) : l->max;
+    }
+    return l->max;
+}
 
 /* Add a new command */
 void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
@@ -87,8 +248,10 @@ void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
     cmd->operation = operation;
     cmd->summary = summary;
     cmd->param = param;
+    cmd->latency = NULL;
     cmd->next = next_cmd;
     *last_loc = cmd;
+    hash_insert(&cmd_table, name, cmd);
 }
 
 /* Add a new parameter */
@@ -109,22 +272,63 @@ void add_param(char *name, int *valp, char *summary, setter_func_t setter)
     param->setter = setter;
     param->next = next_param;
     *last_loc = param;
+    hash_insert(&param_table, name, param);
 }
 
-/* Parse a string into a command line */
+/* Storage for the arguments of the commands being interpreted, one for each
+ * level of nesting, since commands such as repeat, time and select run others
+ * with arguments that must stay valid until they are done, while commands
+ * read in between, such as those of a sourced file, are parsed as well.
+ * Reused from one command to the next at the same level, and only ever
+ * grown, so that interpreting a command does not allocate.
+ */
+typedef struct {
+    char *text;
+    size_t text_size;
+    char **vec;
+    size_t vec_size;
+} arg_buf_t;
+
+static arg_buf_t *arg_bufs = NULL;
+static int arg_bufs_cnt = 0;
+static int arg_depth = 0; /* commands being interpreted */
+
+/* Parse a string into a command line, valid until the next one parsed at the
+ * same level of nesting
+ */
 static char **parse_args(char *line, int *argcp)
 {
-    /* Must first determine how many arguments there are.
-     * Replace all white space with null characters
-     */
     size_t len = strlen(line);
 
-    /* First copy into buffer with each substring null-terminated */
-    char *buf = malloc_or_fail(len + 1, "parse_args");
-    buf[len] = '\0';
+    if (arg_depth >= arg_bufs_cnt) {
+        arg_buf_t *bufs =
+            calloc_or_fail(arg_depth + 1, sizeof(arg_buf_t), "parse_args");
+        if (arg_bufs) {
+            memcpy(bufs, arg_bufs, arg_bufs_cnt * sizeof(arg_buf_t));
+            free_array(arg_bufs, arg_bufs_cnt, sizeof(arg_buf_t));
+        }
+        arg_bufs = bufs;
+        arg_bufs_cnt = arg_depth + 1;
+    }
+
+    /* A line of len characters holds at most (len + 1) / 2 arguments */
+    arg_buf_t *b = &arg_bufs[arg_depth];
+    if (len + 1 > b->text_size) {
+        if (b->text) {
+            free_block(b->text, b->text_size);
+            free_array(b->vec, b->vec_size, sizeof(char *));
+        }
+        b->text_size = len + 1 > RIO_BUFSIZE ? len + 1 : RIO_BUFSIZE;
+        b->vec_size = (b->text_size + 1) / 2;
+        b->text = malloc_or_fail(b->text_size, "parse_args");
+        b->vec = malloc_or_fail(b->vec_size * sizeof(char *), "parse_args");
+    }
 
+    /* Copy into buffer with each substring null-terminated, since the caller
+     * may still need the line itself (e.g. for history)
+     */
     char *src = line;
-    char *dst = buf;
+    char *dst = b->text;
     bool skipping = true;
     int c;
     int argc = 0;
@@ -138,7 +342,7 @@ static char **parse_args(char *line, int *argcp)
         } else {
             if (skipping) {
                 /* Hit start of new word */
-                argc++;
+                b->vec[argc++] = dst;
                 skipping = false;
             }
             *dst++ = c;
@@ -147,19 +351,16 @@ static char **parse_args(char *line, int *argcp)
     /* Let the last substring is null-terminated */
     *dst++ = '\0';
 
-    /* Now assemble into array of strings */
-    char **argv = calloc_or_fail(argc, sizeof(char *), "parse_args");
-    src = buf;
-    for (int i = 0; i < argc; i++) {
-        argv[i] = strsave_or_fail(src, "parse_args");
-        src += strlen(argv[i]) + 1;
-    }
-
-    free_block(buf, len + 1);
     *argcp = argc;
-    return argv;
+    return b->vec;
 }
 
+/* Lines of a repeat block being entered, from 'repeat n {' on */
+static char *block_text = NULL;
+static size_t block_len = 0;
+static size_t block_size = 0;
+static int block_depth = 0;
+
 /* Handles forced console termination for record_error and do_quit */
 static bool force_quit(int argc, char *argv[])
 {
@@ -168,6 +369,8 @@ static bool force_quit(int argc, char *argv[])
     while (c) {
         cmd_element_t *ele = c;
         c = c->next;
+        if (ele->latency)
+            free_array(ele->latency, 1, sizeof(latency_t));
         free_block(ele, sizeof(cmd_element_t));
     }
 
@@ -177,14 +380,45 @@ static bool force_quit(int argc, char *argv[])
         p = p->next;
         free_block(ele, sizeof(param_element_t));
     }
+    cmd_list = NULL;
+    param_list = NULL;
+    hash_free(&cmd_table);
+    hash_free(&param_table);
+
+    if (recording) {
+        journal_close(recording);
+        recording = NULL;
+    }
+
+    if (block_depth) {
+        report(1, "Missing '}' to end repeat block");
+        err_cnt++;
+        free_block(block_text, block_size);
+        block_text = NULL;
+        block_len = block_size = 0;
+        block_depth = 0;
+    }
 
     while (buf_stack)
         pop_file();
+    web_close();
 
     for (int i = 0; i < quit_helper_cnt; i++) {
         ok = ok && quit_helpers[i](argc, argv);
     }
 
+    /* Released last, since argv may point into it */
+    for (int i = 0; i < arg_bufs_cnt; i++) {
+        if (arg_bufs[i].text) {
+            free_block(arg_bufs[i].text, arg_bufs[i].text_size);
+            free_array(arg_bufs[i].vec, arg_bufs[i].vec_size, sizeof(char *));
+        }
+    }
+    if (arg_bufs)
+        free_array(arg_bufs, arg_bufs_cnt, sizeof(arg_buf_t));
+    arg_bufs = NULL;
+    arg_bufs_cnt = 0;
+
     quit_flag = true;
     return ok;
 }
@@ -200,18 +434,32 @@ static void record_error()
     }
 }
 
-/* Execute a command that has already been split into arguments */
-static bool interpret_cmda(int argc, char *argv[])
+/* Find command by name.  Return NULL if there is no such command */
+static cmd_element_t *find_cmd(const char *name)
+{
+    return hash_find(&cmd_table, name);
+}
+
+/* Execute a command already looked up, or report it unknown if NULL */
+/* Commands executed so far */
+static uint64_t executed = 0;
+
+static bool do_comment_cmd(int argc, char *argv[]);
+
+static bool execute_cmd(cmd_element_t *cmd, int argc, char *argv[])
 {
-    if (argc == 0)
-        return true;
-    /* Try to find matching command */
-    cmd_element_t *next_cmd = cmd_list;
     bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
-    if (next_cmd) {
-        ok = next_cmd->operation(argc, argv);
+    if (cmd) {
+        uint64_t before = ++executed;
+        int64_t start = time_ns();
+        ok = cmd->operation(argc, argv);
+        /* Command list is gone if the command quit.  Comments take no time
+         * worth knowing, and the time of commands running others, such as
+         * repeat, is that of the others, which are counted already.
+         */
+        if (!quit_flag && executed == before &&
+            cmd->operation != do_comment_cmd)
+            latency_record(cmd, time_ns() - start);
         if (!ok)
             record_error();
     } else {
@@ -223,6 +471,58 @@ static bool interpret_cmda(int argc, char *argv[])
     return ok;
 }
 
+/* Execute a command that has already been split into arguments */
+bool interpret_cmda(int argc, char *argv[])
+{
+    if (argc == 0)
+        return true;
+    return execute_cmd(find_cmd(argv[0]), argc, argv);
+}
+
+/* Add line to repeat block being entered.  Run the block once complete */
+static bool collect_block(char *line)
+{
+    size_t len = strlen(line);
+    if (block_len + len + 2 > block_size) {
+        size_t size = 2 * (block_len + len + 2);
+        char *text = malloc_or_fail(size, "collect_block");
+        if (block_text) {
+            memcpy(text, block_text, block_len);
+            free_block(block_text, block_size);
+        }
+        block_text = text;
+        block_size = size;
+    }
+    memcpy(block_text + block_len, line, len);
+    block_len += len;
+    if (!len || line[len - 1] != '\n')
+        block_text[block_len++] = '\n';
+
+    int argc;
+    char **argv = parse_args(line, &argc);
+    if (argc == 3 && !strcmp(argv[0], "repeat") && !strcmp(argv[2], "{"))
+        block_depth++;
+    else if (argc == 1 && !strcmp(argv[0], "}"))
+        block_depth--;
+    if (block_depth)
+        return true;
+
+    /* Detached first, in case the block quits */
+    char *text = block_text;
+    size_t len_text = block_len, size = block_size;
+    block_text = NULL;
+    block_len = block_size = 0;
+
+    /* Lines were echoed as they were read */
+    int echo_save = echo;
+    echo = 0;
+    run_block(text, len_text);
+    echo = echo_save;
+
+    free_block(text, size);
+    return true;
+}
+
 /* Execute a command from a command line */
 static bool interpret_cmd(char *cmdline)
 {
@@ -231,11 +531,25 @@ static bool interpret_cmd(char *cmdline)
 
     int argc;
     char **argv = parse_args(cmdline, &argc);
-    bool ok = interpret_cmda(argc, argv);
-    for (int i = 0; i < argc; i++)
-        free_string(argv[i]);
-    free_array(argv, argc, sizeof(char *));
+    if (recording && argc)
+        journal_record(recording, argc, argv);
 
+    /* Commands interpreted until this one is done parse into storage of
+     * their own
+     */
+    bool ok;
+    arg_depth++;
+    if (block_depth ||
+        (argc == 3 && !strcmp(argv[0], "repeat") && !strcmp(argv[2], "{"))) {
+        ok = collect_block(cmdline);
+    } else if (argc == 1 && !strcmp(argv[0], "}")) {
+        report(1, "Unexpected '}' outside of repeat block");
+        record_error();
+        ok = false;
+    } else {
+        ok = interpret_cmda(argc, argv);
+    }
+    arg_depth--;
     return ok;
 }
 
@@ -321,7 +635,6 @@ static bool do_option(int argc, char *argv[])
     for (int i = 1; i < argc; i++) {
         char *name = argv[i];
         int value = 0;
-        bool found = false;
         /* Get value from next argument */
         if (i + 1 >= argc) {
             report(1, "No value given for parameter %s", name);
@@ -330,28 +643,48 @@ static bool do_option(int argc, char *argv[])
             report(1, "Cannot parse '%s' as integer", argv[i]);
             return false;
         }
-        /* Find parameter in list */
-        param_element_t *plist = param_list;
-        while (!found && plist) {
-            if (strcmp(plist->name, name) == 0) {
-                int oldval = *plist->valp;
-                *plist->valp = value;
-                if (plist->setter)
-                    plist->setter(oldval);
-                found = true;
-            } else
-                plist = plist->next;
-        }
-        /* Didn't find parameter */
-        if (!found) {
+        /* Find parameter by name */
+        param_element_t *param = hash_find(&param_table, name);
+        if (!param) {
             report(1, "Unknown parameter '%s'", name);
             return false;
         }
+        int oldval = *param->valp;
+        *param->valp = value;
+        if (param->setter)
+            param->setter(oldval);
     }
 
     return true;
 }
 
+/* Expand each "$$" in file name into the process ID, as a shell does, so
+ * that concurrent runs can each use a file of their own.
+ * Return false if the result does not fit.
+ */
+static bool expand_name(const char *name, char *buf, size_t size)
+{
+    size_t len = 0;
+    while (*name) {
+        if (name[0] == '$' && name[1] == '$') {
+            len += snprintf(buf + len, len < size ? size - len : 0, "%d",
+                            (int) getpid());
+            name += 2;
+        } else {
+            if (len + 1 < size)
+                buf[len] = *name;
+            len++;
+            name++;
+        }
+    }
+    if (len >= size) {
+        report(1, "File name too long");
+        return false;
+    }
+    buf[len] = '\0';
+    return true;
+}
+
 static bool do_source(int argc, char *argv[])
 {
     if (argc < 2) {
@@ -359,7 +692,10 @@ static bool do_source(int argc, char *argv[])
         return false;
     }
 
-    if (!push_file(argv[1])) {
+    char fname[PATH_MAX];
+    if (!expand_name(argv[1], fname, sizeof(fname)))
+        return false;
+    if (!push_file(fname)) {
         report(1, "Could not open source file '%s'", argv[1]);
         return false;
     }
@@ -382,6 +718,39 @@ static bool do_log(int argc, char *argv[])
     return result;
 }
 
+static bool do_record(int argc, char *argv[])
+{
+    if (recording) {
+        journal_close(recording);
+        recording = NULL;
+    }
+    if (argc < 2)
+        return true;
+
+    char fname[PATH_MAX];
+    if (!expand_name(argv[1], fname, sizeof(fname)))
+        return false;
+    recording = journal_open(fname);
+    if (!recording) {
+        report(1, "Could not open journal file '%s'", argv[1]);
+        return false;
+    }
+    return true;
+}
+
+static bool do_convert(int argc, char *argv[])
+{
+    if (argc != 3) {
+        report(1, "Use 'convert <trace> <journal>'");
+        return false;
+    }
+    char src[PATH_MAX], dst[PATH_MAX];
+    if (!expand_name(argv[1], src, sizeof(src)) ||
+        !expand_name(argv[2], dst, sizeof(dst)))
+        return false;
+    return convert_trace(src, dst);
+}
+
 static bool do_time(int argc, char *argv[])
 {
     double delta = delta_time(&last_time);
@@ -402,24 +771,144 @@ static bool do_time(int argc, char *argv[])
     return ok;
 }
 
+static void report_latency(cmd_element_t *cmd)
+{
+    latency_t *l = cmd->latency;
+    report(1, "%-8s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f", cmd->name,
+           (unsigned long) l->count, 1.0E-3 * l->total / l->count,
+           1.0E-3 * latency_percentile(l, 0.5),
+           1.0E-3 * latency_percentile(l, 0.99),
+           1.0E-3 * latency_percentile(l, 0.999), 1.0E-3 * l->max);
+}
+
+static bool do_stats(int argc, char *argv[])
+{
+    bool ok = true;
+    report(1, "%-8s %10s %10s %10s %10s %10s %10s", "Command", "Count",
+           "Mean(us)", "p50(us)", "p99(us)", "p999(us)", "Max(us)");
+    if (argc <= 1) {
+        for (cmd_element_t *cmd = cmd_list; cmd; cmd = cmd->next)
+            if (cmd->latency)
+                report_latency(cmd);
+        return ok;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        cmd_element_t *cmd = find_cmd(argv[i]);
+        if (!cmd) {
+            report(1, "Unknown command '%s'", argv[i]);
+            ok = false;
+        } else if (cmd->latency) {
+            report_latency(cmd);
+        }
+    }
+    return ok;
+}
+
+/* Latency histogram of command in metrics, with its buckets merged into
+ * ones bounded by 1, 2.5 and 5 times powers of ten, from 1 us to 5 s
+ */
+static void latency_metrics(cmd_element_t *cmd)
+{
+    const latency_t *l = cmd->latency;
+    const char *name = "qtest_command_duration_seconds";
+    char metric[64], labels[128];
+    uint64_t seen = 0;
+    int b = 0;
+
+    snprintf(metric, sizeof(metric), "%s_bucket", name);
+    for (int64_t decade = 1000; decade <= 1000000000; decade *= 10) {
+        int64_t bounds[] = {decade, decade * 5 / 2, decade * 5};
+        for (int i = 0; i < 3; i++) {
+            while (b < LATENCY_BUCKETS && latency_value(b) <= bounds[i])
+                seen += l->bucket[b++];
+            snprintf(labels, sizeof(labels), "cmd=\"%s\",le=\"%g\"",
+                     cmd->name, 1.0E-9 * bounds[i]);
+            web_metric(metric, labels, seen);
+        }
+    }
+    snprintf(labels, sizeof(labels), "cmd=\"%s\",le=\"+Inf\"", cmd->name);
+    web_metric(metric, labels, l->count);
+
+    snprintf(labels, sizeof(labels), "cmd=\"%s\"", cmd->name);
+    snprintf(metric, sizeof(metric), "%s_sum", name);
+    web_metric(metric, labels, 1.0E-9 * l->total);
+    snprintf(metric, sizeof(metric), "%s_count", name);
+    web_metric(metric, labels, l->count);
+}
+
+/* Metrics of the commands run, from the statistics kept for 'stats' */
+void cmd_metrics()
+{
+    char labels[128];
+
+    web_metric_help("qtest_commands_total", "counter", "Commands executed");
+    for (cmd_element_t *cmd = cmd_list; cmd; cmd = cmd->next) {
+        if (!cmd->latency)
+            continue;
+        snprintf(labels, sizeof(labels), "cmd=\"%s\"", cmd->name);
+        web_metric("qtest_commands_total", labels, cmd->latency->count);
+    }
+    web_metric_help("qtest_command_errors_total", "counter",
+                    "Commands that failed");
+    web_metric("qtest_command_errors_total", NULL, err_cnt);
+
+    web_metric_help("qtest_command_duration_seconds", "histogram",
+                    "Time taken by commands");
+    for (cmd_element_t *cmd = cmd_list; cmd; cmd = cmd->next)
+        if (cmd->latency)
+            latency_metrics(cmd);
+}
+
+static bool do_repeat(int argc, char *argv[])
+{
+    int count = 0;
+    if (argc < 3 || !get_int(argv[1], &count) || count < 0) {
+        report(1, "Use 'repeat n cmd arg ...', or 'repeat n {' to start a "
+                  "block of commands ending with '}'");
+        return false;
+    }
+
+    /* Blocks are taken care of before getting here */
+    bool ok = true;
+    for (int i = 0; i < count && !quit_flag; i++)
+        ok = interpret_cmda(argc - 2, argv + 2) && ok;
+    return ok;
+}
+
 static bool use_linenoise = true;
 static int web_fd;
 
 static bool do_web(int argc, char *argv[])
 {
-    int port = 9999;
-    if (argc == 2) {
+    int port = 9999, threads = 0;
+    char *path = NULL;
+    if (argc >= 2) {
         if (argv[1][0] >= '0' && argv[1][0] <= '9')
             port = atoi(argv[1]);
+        else
+            path = argv[1];
+    }
+    if (argc >= 3) {
+        if (argv[2][0] >= '0' && argv[2][0] <= '9')
+            threads = atoi(argv[2]);
     }
 
-    web_fd = web_open(port);
+    web_fd = path ? web_open_unix(path, threads) : web_open(port, threads);
     if (web_fd > 0) {
-        printf("listen on port %d, fd is %d\n", port, web_fd);
+        if (path)
+            printf("listen on %s, fd is %d\n", path, web_fd);
+        else
+            printf("listen on port %d, fd is %d\n", port, web_fd);
         line_set_eventmux_callback(web_eventmux);
         use_linenoise = false;
     } else {
-        perror("ERROR");
+        if (path && errno == EADDRINUSE)
+            report(1, "ERROR: Another server is listening on %s", path);
+        else
+            perror("ERROR");
+        /* Any socket bound before failing */
+        web_close();
         exit(web_fd);
     }
     return true;
@@ -436,6 +925,8 @@ void init_cmd()
 {
     cmd_list = NULL;
     param_list = NULL;
+    hash_free(&cmd_table);
+    hash_free(&param_table);
     err_cnt = 0;
     quit_flag = false;
 
@@ -444,10 +935,29 @@ void init_cmd()
                 "Display or set options. See 'Options' section for details",
                 "[name val]");
     ADD_COMMAND(quit, "Exit program", "");
-    ADD_COMMAND(source, "Read commands from source file", "file");
+    ADD_COMMAND(source, "Read commands from source file, or journal", "file");
     ADD_COMMAND(log, "Copy output to file", "file");
     ADD_COMMAND(time, "Time command execution", "cmd arg ...");
-    ADD_COMMAND(web, "Read commands from builtin web server", "[port]");
+    ADD_COMMAND(record,
+                "Record commands into binary journal file, replayed with -f. "
+                "Stop recording if no file is given. $$ in file names stands "
+                "for the process ID",
+                "[file]");
+    ADD_COMMAND(convert, "Convert trace file into binary journal",
+                "trace journal");
+    ADD_COMMAND(stats,
+                "Show execution time statistics of all commands, or of the "
+                "given ones, except comments and commands running others",
+                "[cmd ...]");
+    ADD_COMMAND(repeat,
+                "Execute command n times, or the commands up to '}' if cmd "
+                "is '{'",
+                "n cmd arg ...");
+    ADD_COMMAND(web,
+                "Read commands from builtin web server, or from local clients "
+                "of a Unix-domain socket, with connections served by threads "
+                "if any",
+                "[port|path] [threads]");
     add_cmd("#", do_comment_cmd, "Display comment", "...");
     add_cmd(".", do_no_command, "Empty command", "");
     add_param("simulation", &simulation, "Start/Stop simulation mode", NULL);
@@ -455,6 +965,9 @@ void init_cmd()
     add_param("error", &err_limit, "Number of errors until exit", NULL);
     add_param("echo", &echo, "Do/don't echo commands", NULL);
     add_param("entropy", &show_entropy, "Show/Hide Shannon entropy", NULL);
+    add_param("mblimit", &mblimit,
+              "Maximum megabytes allocated by the queue (0 = no limit)",
+              NULL);
 
     init_in();
     init_time(&last_time);
@@ -463,6 +976,7 @@ void init_cmd()
 
 /* Create new buffer for named file.
  * Name == NULL for stdin.
+ * A journal is replayed right away instead, being no text to read lines of.
  * Return true if successful.
  */
 static bool push_file(char *fname)
@@ -472,6 +986,12 @@ static bool push_file(char *fname)
     if (fd < 0)
         return false;
 
+    if (fname && is_journal_fd(fd)) {
+        run_journal(fd, fname);
+        close(fd);
+        return true;
+    }
+
     if (fd > fd_max)
         fd_max = fd;
 
@@ -599,9 +1119,10 @@ static int cmd_select(int nfds,
             FD_SET(web_fd, readfds);
 
         if (infd == STDIN_FILENO && prompt_flag) {
+            /* May be a command from a web client */
             char *cmdline = linenoise(prompt);
             if (cmdline)
-                interpret_cmd(cmdline);
+                web_cmd_status(interpret_cmd(cmdline));
             fflush(stdout);
             prompt_flag = true;
         } else if (infd != STDIN_FILENO) {
@@ -613,6 +1134,579 @@ static int cmd_select(int nfds,
     return 0;
 }
 
+/* Batch execution of trace files.
+ * The whole file is mapped into memory and compiled up front into an array of
+ * commands, already split into arguments and looked up, which then runs
+ * without any per-line reading, parsing or allocation.
+ * Lines from 'repeat n {' to the matching '}' are compiled into jumps, so
+ * that repeated commands are not parsed again either.
+ */
+
+typedef enum {
+    BATCH_CMD,
+    BATCH_REPEAT, /* repeat n { */
+    BATCH_END,    /* } */
+} batch_kind_t;
+
+typedef struct {
+    batch_kind_t kind;
+    cmd_element_t *cmd; /* NULL for unknown command */
+    int argc;
+    char **argv;
+    const char *line; /* Original text, for echoing.  NULL if there is none */
+    int len;
+    bool seen; /* Executed before, when repeated */
+    int count; /* Iterations of repeat, -1 if invalid */
+    int left;  /* Iterations of repeat left */
+    int match; /* Index of the matching repeat or '}', -1 if none */
+} batch_cmd_t;
+
+typedef struct {
+    batch_cmd_t *cmds;
+    int ncmd;
+    char **argv; /* Storage for all argument vectors */
+    int nargs;
+    char *text; /* Arguments, each null-terminated */
+    size_t size;
+} batch_t;
+
+/* Look up command i, once its arguments are known, and match repeat blocks.
+ * open is the innermost repeat not closed yet, with the enclosing ones
+ * linked through their left fields until their '}' is found.
+ */
+static void batch_classify(batch_t *b, int i, int *open)
+{
+    batch_cmd_t *c = &b->cmds[i];
+    c->kind = BATCH_CMD;
+    c->cmd = c->argc ? find_cmd(c->argv[0]) : NULL;
+    c->seen = false;
+    c->match = -1;
+    if (c->argc == 3 && !strcmp(c->argv[0], "repeat") &&
+        !strcmp(c->argv[2], "{")) {
+        c->kind = BATCH_REPEAT;
+        if (!get_int(c->argv[1], &c->count) || c->count < 0)
+            c->count = -1;
+        c->left = *open;
+        *open = i;
+    } else if (c->argc == 1 && !strcmp(c->argv[0], "}")) {
+        c->kind = BATCH_END;
+        if (*open >= 0) {
+            c->match = *open;
+            b->cmds[*open].match = i;
+            *open = b->cmds[*open].left;
+        }
+    }
+}
+
+/* Split text into lines and arguments, filling batch if cmds is set, and
+ * only counting lines and arguments otherwise.
+ */
+static void batch_scan(batch_t *b, const char *text)
+{
+    const char *end = text + b->size;
+    int ncmd = 0, nargs = 0;
+    int open = -1; /* Innermost repeat not closed yet */
+    for (const char *p = text; p < end; ncmd++) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (!eol)
+            eol = end;
+
+        batch_cmd_t *c = b->cmds ? &b->cmds[ncmd] : NULL;
+        if (c) {
+            c->line = p;
+            c->len = eol - p;
+            c->argc = 0;
+            c->argv = b->argv + nargs;
+        }
+        while (p < eol) {
+            while (p < eol && isspace(*p))
+                p++;
+            if (p == eol)
+                break;
+            const char *word = p;
+            while (p < eol && !isspace(*p))
+                p++;
+            if (c) {
+                char *arg = b->text + (word - text);
+                memcpy(arg, word, p - word);
+                arg[p - word] = '\0';
+                c->argv[c->argc++] = arg;
+            }
+            nargs++;
+        }
+        if (c)
+            batch_classify(b, ncmd, &open);
+        p = eol + 1;
+    }
+    b->ncmd = ncmd;
+    b->nargs = nargs;
+}
+
+/* Compile the mapped text of a trace file */
+static void batch_compile(batch_t *b, const char *text, size_t size)
+{
+    b->size = size;
+    b->cmds = NULL;
+    batch_scan(b, text);
+
+    b->cmds = malloc_or_fail(sizeof(batch_cmd_t) * (b->ncmd + 1), "batch");
+    b->argv = malloc_or_fail(sizeof(char *) * (b->nargs + 1), "batch");
+    b->text = malloc_or_fail(size + 1, "batch");
+    batch_scan(b, text);
+}
+
+static void batch_free(batch_t *b)
+{
+    free_block(b->text, b->size + 1);
+    free_array(b->argv, b->nargs + 1, sizeof(char *));
+    free_array(b->cmds, b->ncmd + 1, sizeof(batch_cmd_t));
+}
+
+/* Run batch, recording its commands into any journal if record is set */
+static void batch_run(batch_t *b, bool record)
+{
+    rio_t *base = buf_stack;
+    for (int i = 0; i < b->ncmd && !quit_flag; i++) {
+        batch_cmd_t *c = &b->cmds[i];
+        /* Lines of repeat blocks are only echoed the first time */
+        if (!c->seen) {
+            if (echo && c->line) {
+                report_noreturn(1, prompt);
+                report(1, "%.*s", c->len, c->line);
+            } else if (echo && c->argc) {
+                /* Rebuilt from the arguments */
+                char line[RIO_BUFSIZE];
+                size_t len = 0;
+                for (int j = 0; j < c->argc && len < sizeof(line); j++)
+                    len += snprintf(line + len, sizeof(line) - len, "%s%s",
+                                    j ? " " : "", c->argv[j]);
+                report_noreturn(1, prompt);
+                report(1, "%s", line);
+            }
+            if (record && recording && c->argc)
+                journal_record(recording, c->argc, c->argv);
+            c->seen = true;
+        }
+
+        switch (c->kind) {
+        case BATCH_CMD:
+            if (c->argc)
+                execute_cmd(c->cmd, c->argc, c->argv);
+            break;
+        case BATCH_REPEAT:
+            /* The lines after an unfinished block still run, once */
+            if (c->match < 0) {
+                report(1, "Missing '}' to end repeat block of line %d", i + 1);
+                record_error();
+                break;
+            }
+            if (c->count < 0) {
+                report(1, "Invalid repeat count '%s'", c->argv[1]);
+                record_error();
+            }
+            c->left = c->count;
+            if (c->left <= 0)
+                i = c->match;
+            break;
+        case BATCH_END:
+            if (c->match < 0) {
+                report(1, "Unexpected '}' outside of repeat block");
+                record_error();
+            } else if (--b->cmds[c->match].left > 0) {
+                i = c->match;
+            }
+            break;
+        }
+
+        /* Commands of any file pushed by 'source' go first */
+        while (buf_stack != base && !quit_flag)
+            cmd_select(0, NULL, NULL, NULL, NULL);
+    }
+}
+
+/* Run commands of a repeat block entered line by line */
+static void run_block(const char *text, size_t size)
+{
+    batch_t b;
+    batch_compile(&b, text, size);
+    batch_run(&b, false);
+    batch_free(&b);
+}
+
+/* Map whole of open file into memory.  Return false if it could not be */
+static bool map_fd(int fd, char **textp, size_t *sizep)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        return false;
+
+    char *text = NULL;
+    if (st.st_size > 0) {
+        text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (text == MAP_FAILED)
+            return false;
+    }
+
+    *textp = text;
+    *sizep = st.st_size;
+    return true;
+}
+
+/* Map whole file into memory.  Return false if it could not be read */
+static bool map_file(const char *fname, char **textp, size_t *sizep)
+{
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    bool ok = map_fd(fd, textp, sizep);
+    close(fd);
+    return ok;
+}
+
+static void unmap_file(char *text, size_t size)
+{
+    if (text)
+        munmap(text, size);
+}
+
+/* Command journal.
+ * A session can be recorded into a compact binary journal, which is then
+ * replayed without any parsing.  After JOURNAL_MAGIC, it is a sequence of
+ * records, each starting with an op, where all numbers are unsigned LEB128
+ * varints:
+ *   op 0      definition of the next string: length, then its characters
+ *   op n > 0  command named by string n - 1: number of arguments, then for
+ *             each either string s as s << 1, or integer v as v << 1 | 1
+ * Strings are numbered from 0 in order of definition, and each one is
+ * defined just before its first use, so that a journal can be written as
+ * commands are run.
+ */
+#define JOURNAL_MAGIC "QJNL\1"
+#define JOURNAL_MAGIC_LEN 5
+
+struct __journal {
+    FILE *file;
+    hash_table_t strings; /* String number + 1, by string */
+    uint64_t nstrings;
+};
+
+/* Create journal file.  Return NULL if it could not be opened */
+static journal_t *journal_open(const char *fname)
+{
+    FILE *file = fopen(fname, "w");
+    if (!file)
+        return NULL;
+
+    journal_t *j = malloc_or_fail(sizeof(journal_t), "journal_open");
+    j->file = file;
+    j->strings = (hash_table_t){0};
+    j->nstrings = 0;
+    fwrite(JOURNAL_MAGIC, 1, JOURNAL_MAGIC_LEN, j->file);
+    return j;
+}
+
+static void journal_close(journal_t *j)
+{
+    fclose(j->file);
+    for (size_t i = 0; i < j->strings.capacity; i++) {
+        if (j->strings.slots[i].name)
+            free_string((char *) j->strings.slots[i].name);
+    }
+    hash_free(&j->strings);
+    free_block(j, sizeof(journal_t));
+}
+
+static void journal_put(journal_t *j, uint64_t v)
+{
+    do {
+        int byte = v & 0x7f;
+        v >>= 7;
+        putc(byte | (v ? 0x80 : 0), j->file);
+    } while (v);
+}
+
+/* Number of string, defining it first if new */
+static uint64_t journal_string(journal_t *j, const char *s)
+{
+    void *ele = hash_find(&j->strings, s);
+    if (ele)
+        return (uintptr_t) ele - 1;
+
+    size_t len = strlen(s);
+    journal_put(j, 0);
+    journal_put(j, len);
+    fwrite(s, 1, len, j->file);
+    hash_insert(&j->strings, strsave_or_fail(s, "journal_string"),
+                (void *) (uintptr_t) ++j->nstrings);
+    return j->nstrings - 1;
+}
+
+/* Value of argument, if it is written as a plain decimal integer */
+static bool journal_int(const char *s, uint64_t *valp)
+{
+    size_t len = strlen(s);
+    if (!len || len > 18 || (s[0] == '0' && len > 1))
+        return false;
+
+    uint64_t val = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (!isdigit(s[i]))
+            return false;
+        val = 10 * val + (s[i] - '0');
+    }
+    *valp = val;
+    return true;
+}
+
+static void journal_record(journal_t *j, int argc, char *argv[])
+{
+    /* Their effect is recorded instead */
+    if (!strcmp(argv[0], "source") || !strcmp(argv[0], "record"))
+        return;
+
+    /* New strings are defined before the command using them */
+    uint64_t val;
+    uint64_t op = journal_string(j, argv[0]) + 1;
+    for (int i = 1; i < argc; i++) {
+        if (!journal_int(argv[i], &val))
+            journal_string(j, argv[i]);
+    }
+
+    journal_put(j, op);
+    journal_put(j, argc - 1);
+    for (int i = 1; i < argc; i++) {
+        if (journal_int(argv[i], &val))
+            journal_put(j, val << 1 | 1);
+        else
+            journal_put(j, journal_string(j, argv[i]) << 1);
+    }
+}
+
+static bool journal_get(const unsigned char **pp,
+                        const unsigned char *end,
+                        uint64_t *valp)
+{
+    uint64_t val = 0;
+    for (int shift = 0; *pp < end && shift < 64; shift += 7) {
+        unsigned char byte = *(*pp)++;
+        val |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *valp = val;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Decode journal like batch_scan does text: filling batch if cmds is set,
+ * and otherwise only counting commands, arguments and strings, and sizing
+ * the text.  Return false if the journal is corrupt.
+ */
+static bool journal_scan(batch_t *b,
+                         char **strs,
+                         uint64_t *nstringsp,
+                         const unsigned char *p,
+                         const unsigned char *end)
+{
+    char *text = b->cmds ? b->text : NULL;
+    size_t nchars = 0;
+    uint64_t nstrings = 0;
+    int ncmd = 0, nargs = 0;
+    int open = -1; /* Innermost repeat not closed yet */
+
+    while (p < end) {
+        uint64_t op, len, argc;
+        if (!journal_get(&p, end, &op))
+            return false;
+        if (!op) {
+            if (!journal_get(&p, end, &len) || len > end - p)
+                return false;
+            if (text) {
+                strs[nstrings] = text + nchars;
+                memcpy(text + nchars, p, len);
+                text[nchars + len] = '\0';
+            }
+            nstrings++;
+            nchars += len + 1;
+            p += len;
+            continue;
+        }
+
+        /* Every argument takes at least a byte */
+        if (op > nstrings || !journal_get(&p, end, &argc) || argc > end - p)
+            return false;
+        batch_cmd_t *c = text ? &b->cmds[ncmd] : NULL;
+        if (c) {
+            c->line = NULL;
+            c->len = 0;
+            c->argc = argc + 1;
+            c->argv = b->argv + nargs;
+            c->argv[0] = strs[op - 1];
+        }
+        nargs++;
+        for (uint64_t i = 1; i <= argc; i++, nargs++) {
+            uint64_t arg;
+            if (!journal_get(&p, end, &arg))
+                return false;
+            if (!(arg & 1) && (arg >> 1) >= nstrings)
+                return false;
+            if (!(arg & 1)) {
+                if (c)
+                    c->argv[i] = strs[arg >> 1];
+            } else if (c) {
+                c->argv[i] = text + nchars;
+                nchars += sprintf(text + nchars, "%" PRIu64, arg >> 1) + 1;
+            } else {
+                nchars += 21; /* Room for any 64-bit number */
+            }
+        }
+        if (c)
+            batch_classify(b, ncmd, &open);
+        ncmd++;
+    }
+
+    b->ncmd = ncmd;
+    b->nargs = nargs;
+    if (!text)
+        b->size = nchars;
+    *nstringsp = nstrings;
+    return true;
+}
+
+/* Compile the mapped contents of a journal.  Return false if corrupt */
+static bool journal_compile(batch_t *b, const char *data, size_t size)
+{
+    const unsigned char *p = (const unsigned char *) data + JOURNAL_MAGIC_LEN;
+    const unsigned char *end = (const unsigned char *) data + size;
+    uint64_t nstrings;
+
+    b->cmds = NULL;
+    if (!journal_scan(b, NULL, &nstrings, p, end))
+        return false;
+
+    b->cmds = malloc_or_fail(sizeof(batch_cmd_t) * (b->ncmd + 1), "journal");
+    b->argv = malloc_or_fail(sizeof(char *) * (b->nargs + 1), "journal");
+    b->text = malloc_or_fail(b->size + 1, "journal");
+    char **strs =
+        malloc_or_fail(sizeof(char *) * (nstrings + 1), "journal_compile");
+    journal_scan(b, strs, &nstrings, p, end);
+    free_array(strs, nstrings + 1, sizeof(char *));
+    return true;
+}
+
+static bool is_journal(const char *data, size_t size)
+{
+    return size >= JOURNAL_MAGIC_LEN &&
+           !memcmp(data, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN);
+}
+
+/* Whether open file is a journal, leaving its offset alone */
+static bool is_journal_fd(int fd)
+{
+    char magic[JOURNAL_MAGIC_LEN];
+    return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+           is_journal(magic, sizeof(magic));
+}
+
+/* Write the commands of a text trace into a journal, without running them */
+static bool convert_trace(const char *src, const char *dst)
+{
+    char *text;
+    size_t size;
+    if (!map_file(src, &text, &size)) {
+        report(1, "Could not open source file '%s'", src);
+        return false;
+    }
+    if (is_journal(text, size)) {
+        report(1, "'%s' is a journal already", src);
+        unmap_file(text, size);
+        return false;
+    }
+
+    journal_t *j = journal_open(dst);
+    if (!j) {
+        report(1, "Could not open journal file '%s'", dst);
+        unmap_file(text, size);
+        return false;
+    }
+
+    batch_t b;
+    batch_compile(&b, text, size);
+    int cnt = 0;
+    for (int i = 0; i < b.ncmd; i++) {
+        if (b.cmds[i].argc) {
+            journal_record(j, b.cmds[i].argc, b.cmds[i].argv);
+            cnt++;
+        }
+    }
+    batch_free(&b);
+    unmap_file(text, size);
+    journal_close(j);
+    report(1, "Converted %d commands", cnt);
+    return true;
+}
+
+/* Whether a journal is being replayed */
+static bool replaying = false;
+
+/* Run mapped trace file or journal in batch mode, then unmap it.
+ * A trace may source journals, which then run within its batch, each with
+ * its own.  Journals never record 'source', so that only a corrupt one could
+ * source another journal, or itself: this is refused.
+ */
+static void run_mapped(const char *fname, char *text, size_t size)
+{
+    bool journal = is_journal(text, size);
+    batch_t b;
+    if (journal && replaying) {
+        report(1, "Journal '%s' sourced while replaying a journal", fname);
+        record_error();
+        unmap_file(text, size);
+        return;
+    }
+    if (!journal) {
+        batch_compile(&b, text, size);
+    } else if (!journal_compile(&b, text, size)) {
+        report(1, "Journal '%s' is corrupt", fname);
+        record_error();
+        unmap_file(text, size);
+        return;
+    }
+    bool was_replaying = replaying;
+    replaying = journal;
+    batch_run(&b, true);
+    replaying = was_replaying;
+    batch_free(&b);
+    unmap_file(text, size);
+}
+
+/* Run trace file or journal in batch mode.
+ * Return false if it could not be read.
+ */
+static bool run_batch(const char *fname)
+{
+    char *text;
+    size_t size;
+    if (!map_file(fname, &text, &size))
+        return false;
+    run_mapped(fname, text, size);
+    return true;
+}
+
+/* Replay open journal for 'source' */
+static void run_journal(int fd, const char *fname)
+{
+    char *text;
+    size_t size;
+    if (!map_fd(fd, &text, &size)) {
+        report(1, "Could not read journal '%s'", fname);
+        record_error();
+        return;
+    }
+    run_mapped(fname, text, size);
+}
+
 bool finish_cmd()
 {
     bool ok = true;
@@ -663,14 +1757,122 @@ void completion(const char *buf, line_completions_t *lc)
     }
 }
 
+/* Run a command from a web client, with any file it sources */
+static void run_web_cmd(char *cmdline)
+{
+    rio_t *base = buf_stack;
+    bool ok = interpret_cmd(cmdline);
+    while (buf_stack != base && !quit_flag)
+        cmd_select(0, NULL, NULL, NULL, NULL);
+    web_cmd_status(ok);
+}
+
+/* Serve web clients until one of them quits, once stdin is closed */
+static void run_web()
+{
+    char cmdline[RIO_BUFSIZE];
+    web_stdin_closed();
+    while (!quit_flag) {
+        fflush(stdout);
+        int len = web_eventmux(cmdline);
+        if (len < 0)
+            break;
+        if (len > 0)
+            run_web_cmd(cmdline);
+    }
+}
+
+/* Pipelined execution of commands from standard input, when it is not a
+ * terminal.  Input is read in large chunks, and the complete lines of each
+ * chunk are interpreted back to back.  Once the web server is started, its
+ * clients are served whenever more input is waited for, and after the end of
+ * input.
+ */
+#define PIPE_BUFSIZE (1 << 20)
+
+static void run_pipe()
+{
+    size_t size = PIPE_BUFSIZE, len = 0;
+    char *buf = malloc_or_fail(size, "run_pipe");
+    rio_t *base = buf_stack;
+
+    while (!quit_flag) {
+        if (len == size) {
+            /* Line longer than buffer */
+            char *bigger = malloc_or_fail(2 * size, "run_pipe");
+            memcpy(bigger, buf, len);
+            free_block(buf, size);
+            buf = bigger;
+            size *= 2;
+        }
+
+        /* Output may be waited for before more input comes */
+        fflush(stdout);
+        if (!use_linenoise) {
+            char cmdline[RIO_BUFSIZE];
+            int cmdlen = web_eventmux(cmdline);
+            if (cmdlen > 0) {
+                run_web_cmd(cmdline);
+                continue;
+            }
+        }
+        ssize_t n = read(STDIN_FILENO, buf + len, size - len - 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            /* Last line may not be terminated */
+            if (len) {
+                buf[len] = '\0';
+                interpret_cmd(buf);
+            }
+            if (!use_linenoise && !quit_flag)
+                run_web();
+            break;
+        }
+
+        char *line = buf, *end = buf + len + n;
+        char *eol;
+        while (!quit_flag && (eol = memchr(line, '\n', end - line))) {
+            *eol = '\0';
+            interpret_cmd(line);
+            line = eol + 1;
+            /* Commands of any file pushed by 'source' go first */
+            while (buf_stack != base && !quit_flag)
+                cmd_select(0, NULL, NULL, NULL, NULL);
+        }
+        len = end - line;
+        memmove(buf, line, len);
+    }
+
+    free_block(buf, size);
+}
+
 bool run_console(char *infile_name)
 {
+    /* Output is only waited for by another program */
+    bool buffered = !isatty(STDOUT_FILENO);
+
+    if (infile_name) {
+        set_output_buffering(buffered);
+        bool ok = run_batch(infile_name);
+        set_output_buffering(false);
+        if (!ok) {
+            report(1, "ERROR: Could not open source file '%s'", infile_name);
+            return false;
+        }
+        return err_cnt == 0;
+    }
+
     if (!push_file(infile_name)) {
         report(1, "ERROR: Could not open source file '%s'", infile_name);
         return false;
     }
 
-    if (!has_infile) {
+    if (!has_infile && !isatty(STDIN_FILENO)) {
+        set_output_buffering(buffered);
+        run_pipe();
+        set_output_buffering(false);
+    } else if (!has_infile) {
         char *cmdline;
         while (use_linenoise && (cmdline = linenoise(prompt))) {
             interpret_cmd(cmdline);
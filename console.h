@@ -24,6 +24,7 @@ typedef struct __cmd_element {
     cmd_func_t operation;
     char *summary;
     char *param;
+    struct __latency *latency; /* Execution times, NULL until first run */
     struct __cmd_element *next;
 } cmd_element_t;
 
@@ -50,6 +51,9 @@ void add_cmd(char *name, cmd_func_t operation, char *summary, char *parameter);
 /* Add a new parameter */
 void add_param(char *name, int *valp, char *summary, setter_func_t setter);
 
+/* Execute command already split into arguments, as from another command */
+bool interpret_cmda(int argc, char *argv[]);
+
 /* Extract integer from text and store at loc */
 bool get_int(char *vname, int *loc);
 
@@ -59,6 +63,9 @@ void add_quit_helper(cmd_func_t qf);
 /* Turn echoing on/off */
 void set_echo(bool on);
 
+/* Write metrics of the commands run, for the web server */
+void cmd_metrics();
+
 /* Complete command interpretation */
 
 /* Return true if no errors occurred */
@@ -1,11 +1,19 @@
 /* Test support code */
 
+/* For dladdr */
+#define _GNU_SOURCE
+#include <dlfcn.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdalign.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "report.h"
@@ -25,17 +33,27 @@
 /* Value at end of every block */
 #define MAGICFOOTER 0xbeefdead
 
+/* Value at start of every block allocated in guard mode */
+#define MAGICGUARD 0xfeedbeef
+
+/* Value when block is freed in batch free mode, but not yet released */
+#define MAGICBATCH 0xbadcafe
+
+/* Likewise, for a block allocated in guard mode */
+#define MAGICBATCHGUARD 0xbadfeed
+
 /* Byte to fill newly malloced space with */
 #define FILLCHAR 0x55
 
 /* Data structures used by our code */
 
 /* Represent allocated blocks as doubly-linked list, with
- * next and prev pointers at beginning
+ * next and prev pointers at beginning.
  */
 typedef struct __block_element {
     struct __block_element *next, *prev;
     size_t payload_size;
+    void *site;          /* Where the block was allocated, if recorded */
     size_t magic_header; /* Marker to see if block seems legitimate */
     unsigned char payload[0];
     /* Also place magic number at tail of every block */
@@ -47,17 +65,58 @@ static size_t allocated_count = 0;
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
+/* Place each new block against an inaccessible page when nonzero */
+int guard_mode = 0;
+
+/* Record the allocation site of each block when nonzero */
+int record_sites = 0;
+
+/* Return address of the caller of the allocation function, if recording */
+#define CALLER_SITE() (record_sites ? __builtin_return_address(0) : NULL)
+
+/* How many freed guard-mode blocks stay inaccessible before being unmapped */
+#define GUARD_QUARANTINE 1024
+
+/* Memory mapping backing a guard-mode block */
+typedef struct {
+    void *base;
+    size_t len;
+} guard_map_t;
+
+static guard_map_t quarantine[GUARD_QUARANTINE];
+static size_t quarantine_next = 0;
+static size_t page_size = 0;
+
+/* Blocks freed in batch free mode, released when the mode is unset */
+static block_element_t **batch = NULL;
+static size_t batch_count = 0;
+static size_t batch_capacity = 0;
+
 static bool cautious_mode = true;
 static bool noallocate_mode = false;
+static bool batch_mode = false;
 static bool error_occurred = false;
 static char *error_message = "";
 
-static int time_limit = 1;
+/* Seconds allowed for each risky operation */
+int time_limit = 1;
 
 /* Data for managing exceptions */
-static jmp_buf env;
+static sigjmp_buf env;
 static volatile sig_atomic_t jmp_ready = false;
-static bool time_limited = false;
+static volatile sig_atomic_t time_limited = false;
+
+/* Watchdog enforcing the time limit.
+ * The interval timer is only armed when none is pending, and is left running
+ * when a risky operation completes: whoever is running when it expires either
+ * gets interrupted, or rearms it for its own remaining time.  Thus back-to-back
+ * operations only record their deadline, without making any system call.
+ * Only a deadline before the pending expiry, once the limit was lowered,
+ * needs the timer to be armed again.
+ */
+static volatile int64_t deadline = 0; /* in nanoseconds */
+static volatile int64_t watchdog_expiry = 0;
+static volatile sig_atomic_t watchdog_pending = false;
 
 /* For test_malloc and test_calloc */
 typedef enum {
@@ -102,7 +161,7 @@ static block_element_t *find_header(void *p)
         }
     }
 
-    if (b->magic_header != MAGICHEADER) {
+    if (b->magic_header != MAGICHEADER && b->magic_header != MAGICGUARD) {
         report_event(
             MSG_ERROR,
             "Attempted to free unallocated or corrupted block.  Address = %p",
@@ -122,7 +181,67 @@ static size_t *find_footer(block_element_t *b)
     return p;
 }
 
-static void *alloc(alloc_t alloc_type, size_t size)
+/* Bytes of accessible pages holding a guard-mode block of given size,
+ * leaving room to align its payload
+ */
+static size_t guard_span(size_t size)
+{
+    size_t span = sizeof(block_element_t) + size + alignof(max_align_t) - 1;
+    return (span + page_size - 1) & ~(page_size - 1);
+}
+
+/* Given guard-mode block, find the mapping containing it */
+static guard_map_t guard_map(block_element_t *b)
+{
+    size_t span = guard_span(b->payload_size);
+    size_t end = (size_t) b->payload + b->payload_size;
+    end = (end + page_size - 1) & ~(page_size - 1);
+    guard_map_t m = {
+        .base = (void *) (end - span),
+        .len = span + page_size,
+    };
+    return m;
+}
+
+/* Map a block so that its payload ends next to an inaccessible page.
+ * The payload is as aligned as malloc would return it, which leaves fewer
+ * than alignof(max_align_t) bytes between its end and the guard page: any
+ * access beyond those faults immediately.
+ */
+static block_element_t *guard_alloc(size_t size)
+{
+    if (!page_size)
+        page_size = (size_t) sysconf(_SC_PAGESIZE);
+
+    size_t span = guard_span(size);
+    char *base = mmap(NULL, span + page_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    if (mprotect(base + span, page_size, PROT_NONE)) {
+        munmap(base, span + page_size);
+        return NULL;
+    }
+    size_t payload = (size_t) base + span - size;
+    payload &= ~(alignof(max_align_t) - 1);
+    return (block_element_t *) (payload - sizeof(block_element_t));
+}
+
+/* Make a freed guard-mode block inaccessible, so that later use faults.
+ * The oldest quarantined block is unmapped to bound memory consumption.
+ */
+static void guard_free(block_element_t *b)
+{
+    guard_map_t m = guard_map(b);
+    guard_map_t *slot = &quarantine[quarantine_next];
+    if (slot->base)
+        munmap(slot->base, slot->len);
+    mprotect(m.base, m.len, PROT_NONE);
+    *slot = m;
+    quarantine_next = (quarantine_next + 1) % GUARD_QUARANTINE;
+}
+
+static void *alloc(alloc_t alloc_type, size_t size, void *site)
 {
     if (noallocate_mode) {
         char *msg_alloc_forbidden[] = {
@@ -142,18 +261,38 @@ static void *alloc(alloc_t alloc_type, size_t size)
         return NULL;
     }
 
-    block_element_t *new_block =
-        malloc(size + sizeof(block_element_t) + sizeof(size_t));
+    if (!mem_acquire(size)) {
+        report_event(MSG_ERROR, "Exceeded memory limit of %d megabytes",
+                     mblimit);
+        error_occurred = true;
+        return NULL;
+    }
+
+    /* Each guarded block takes two mappings, of which the kernel allows a
+     * limited number, so that guard mode is turned off once they run out
+     */
+    block_element_t *new_block = guard_mode ? guard_alloc(size) : NULL;
+    bool guarded = new_block;
+    if (guard_mode && !guarded) {
+        report_event(MSG_ERROR,
+                     "Out of memory mappings for guard pages, turning guard "
+                     "mode off");
+        guard_mode = 0;
+    }
+    if (!guarded)
+        new_block = malloc(size + sizeof(block_element_t) + sizeof(size_t));
     if (!new_block) {
         report_event(MSG_FATAL, "Couldn't allocate any more memory");
         error_occurred = true;
     }
 
     // cppcheck-suppress nullPointerRedundantCheck
-    new_block->magic_header = MAGICHEADER;
+    new_block->magic_header = guarded ? MAGICGUARD : MAGICHEADER;
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->payload_size = size;
-    *find_footer(new_block) = MAGICFOOTER;
+    new_block->site = site;
+    if (!guarded)
+        *find_footer(new_block) = MAGICFOOTER;
     void *p = (void *) &new_block->payload;
     memset(p, !alloc_type * FILLCHAR, size);
     // cppcheck-suppress nullPointerRedundantCheck
@@ -169,11 +308,99 @@ static void *alloc(alloc_t alloc_type, size_t size)
     return p;
 }
 
+/* Unlink block from list of allocated blocks and give back its memory */
+static void release(block_element_t *b)
+{
+    block_element_t *bn = b->next;
+    block_element_t *bp = b->prev;
+    if (bp)
+        bp->next = bn;
+    else
+        allocated = bn;
+    if (bn)
+        bn->prev = bp;
+
+    mem_release(b->payload_size);
+    if (b->magic_header == MAGICGUARD || b->magic_header == MAGICBATCHGUARD) {
+        b->magic_header = MAGICFREE;
+        guard_free(b);
+    } else {
+        /* Deferred blocks were filled already */
+        if (b->magic_header != MAGICBATCH)
+            memset(b->payload, FILLCHAR, b->payload_size);
+        b->magic_header = MAGICFREE;
+        *find_footer(b) = MAGICFREE;
+        free(b);
+    }
+    allocated_count--;
+}
+
+/* Defer freeing of a block until the end of batch free mode.
+ * The block is checked and its payload filled right away, as if it were
+ * released, so that any later use shows up as it would without batching.
+ * Only unlinking and giving back its memory are left for later.
+ * A second free of the same block is caught by the header change.
+ */
+static void batch_defer(void *p)
+{
+    block_element_t *b =
+        (block_element_t *) ((size_t) p - sizeof(block_element_t));
+    bool guarded = b->magic_header == MAGICGUARD;
+    if (b->magic_header != MAGICHEADER && !guarded) {
+        report_event(
+            MSG_ERROR,
+            "Attempted to free unallocated or corrupted block.  Address = %p",
+            p);
+        error_occurred = true;
+        return;
+    }
+    /* Rather than searching the list of allocated blocks, which would make
+     * freeing a big queue quadratic, make sure the neighbours of the block
+     * point back at it, as they do only for a block in the list.
+     */
+    if (cautious_mode && ((b->prev ? b->prev->next : allocated) != b ||
+                          (b->next && b->next->prev != b))) {
+        report_event(MSG_ERROR,
+                     "Attempted to free unallocated block.  Address = %p", p);
+        error_occurred = true;
+        return;
+    }
+    if (!guarded && *find_footer(b) != MAGICFOOTER) {
+        report_event(MSG_ERROR,
+                     "Corruption detected in block with address %p when "
+                     "attempting to free it",
+                     p);
+        error_occurred = true;
+    }
+
+    if (batch_count == batch_capacity) {
+        size_t capacity = batch_capacity ? batch_capacity * 2 : 1024;
+        block_element_t **nbatch = realloc(batch, capacity * sizeof(*batch));
+        if (!nbatch) {
+            report_event(MSG_FATAL, "Couldn't allocate any more memory");
+            return;
+        }
+        batch = nbatch;
+        batch_capacity = capacity;
+    }
+    memset(b->payload, FILLCHAR, b->payload_size);
+    b->magic_header = guarded ? MAGICBATCHGUARD : MAGICBATCH;
+    batch[batch_count++] = b;
+}
+
+/* Release all blocks deferred in batch free mode */
+static void batch_release()
+{
+    for (size_t i = 0; i < batch_count; i++)
+        release(batch[i]);
+    batch_count = 0;
+}
+
 /* Implementation of application functions */
 
 void *test_malloc(size_t size)
 {
-    return alloc(TEST_MALLOC, size);
+    return alloc(TEST_MALLOC, size, CALLER_SITE());
 }
 
 // cppcheck-suppress unusedFunction
@@ -184,7 +411,7 @@ void *test_calloc(size_t nelem, size_t elsize)
      */
     if (!nelem || !elsize || nelem > SIZE_MAX / elsize)
         return NULL;
-    return alloc(TEST_CALLOC, nelem * elsize);
+    return alloc(TEST_CALLOC, nelem * elsize, CALLER_SITE());
 }
 
 void test_free(void *p)
@@ -197,38 +424,27 @@ void test_free(void *p)
     if (!p)
         return;
 
+    if (batch_mode) {
+        batch_defer(p);
+        return;
+    }
+
     block_element_t *b = find_header(p);
-    size_t footer = *find_footer(b);
-    if (footer != MAGICFOOTER) {
+    if (b->magic_header != MAGICGUARD && *find_footer(b) != MAGICFOOTER) {
         report_event(MSG_ERROR,
                      "Corruption detected in block with address %p when "
                      "attempting to free it",
                      p);
         error_occurred = true;
     }
-    b->magic_header = MAGICFREE;
-    *find_footer(b) = MAGICFREE;
-    memset(p, FILLCHAR, b->payload_size);
-
-    /* Unlink from list */
-    block_element_t *bn = b->next;
-    block_element_t *bp = b->prev;
-    if (bp)
-        bp->next = bn;
-    else
-        allocated = bn;
-    if (bn)
-        bn->prev = bp;
-
-    free(b);
-    allocated_count--;
+    release(b);
 }
 
 // cppcheck-suppress unusedFunction
 char *test_strdup(const char *s)
 {
     size_t len = strlen(s) + 1;
-    void *new = test_malloc(len);
+    void *new = alloc(TEST_MALLOC, len, CALLER_SITE());
     if (!new)
         return NULL;
 
@@ -240,6 +456,91 @@ size_t allocation_check()
     return allocated_count;
 }
 
+/* Blocks still allocated, aggregated by allocation site and size */
+typedef struct {
+    void *site;
+    size_t size;
+    size_t count;
+} leak_t;
+
+static int cmp_leak_site(const void *a, const void *b)
+{
+    const leak_t *la = a, *lb = b;
+    if (la->site != lb->site)
+        return (uintptr_t) la->site < (uintptr_t) lb->site ? -1 : 1;
+    if (la->size != lb->size)
+        return la->size < lb->size ? -1 : 1;
+    return 0;
+}
+
+static int cmp_leak_bytes(const void *a, const void *b)
+{
+    const leak_t *la = a, *lb = b;
+    size_t bytes_a = la->size * la->count, bytes_b = lb->size * lb->count;
+    if (bytes_a != bytes_b)
+        return bytes_a > bytes_b ? -1 : 1;
+    return la->count > lb->count ? -1 : la->count < lb->count;
+}
+
+/* Maximum number of rows printed by leak_report */
+#define LEAK_REPORT_ROWS 16
+
+void leak_report(int vlevel)
+{
+    if (!allocated_count)
+        return;
+
+    leak_t *leaks = malloc(allocated_count * sizeof(leak_t));
+    if (!leaks)
+        return;
+
+    size_t n = 0;
+    for (block_element_t *b = allocated; b && n < allocated_count;
+         b = b->next) {
+        leaks[n].site = b->site;
+        leaks[n].size = b->payload_size;
+        leaks[n].count = 1;
+        n++;
+    }
+
+    /* Merge identical site and size pairs, then order by bytes leaked */
+    qsort(leaks, n, sizeof(leak_t), cmp_leak_site);
+    size_t groups = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (groups && !cmp_leak_site(&leaks[groups - 1], &leaks[i]))
+            leaks[groups - 1].count++;
+        else
+            leaks[groups++] = leaks[i];
+    }
+    qsort(leaks, groups, sizeof(leak_t), cmp_leak_bytes);
+
+    report(vlevel, "Leaked blocks by allocation site:");
+    report(vlevel, "  %8s %8s %10s  %s", "count", "size", "bytes", "site");
+    for (size_t i = 0; i < groups && i < LEAK_REPORT_ROWS; i++) {
+        char site[128] = "unknown (use 'option sites 1')";
+        Dl_info info;
+        if (leaks[i].site && dladdr(leaks[i].site, &info) && info.dli_fname) {
+            const char *fname = strrchr(info.dli_fname, '/');
+            fname = fname ? fname + 1 : info.dli_fname;
+            if (info.dli_sname)
+                snprintf(site, sizeof(site), "%s+0x%zx (%s)", info.dli_sname,
+                         (size_t) leaks[i].site - (size_t) info.dli_saddr,
+                         fname);
+            else
+                snprintf(site, sizeof(site), "%s+0x%zx", fname,
+                         (size_t) leaks[i].site - (size_t) info.dli_fbase);
+        } else if (leaks[i].site) {
+            snprintf(site, sizeof(site), "%p", leaks[i].site);
+        }
+        report(vlevel, "  %8zu %8zu %10zu  %s", leaks[i].count, leaks[i].size,
+               leaks[i].count * leaks[i].size, site);
+    }
+    if (groups > LEAK_REPORT_ROWS)
+        report(vlevel, "  ... %zu more", groups - LEAK_REPORT_ROWS);
+
+    free(leaks);
+}
+
 /* Implementation of functions for testing */
 
 /* Set/unset cautious mode.
@@ -258,6 +559,16 @@ void set_noallocate_mode(bool noallocate)
     noallocate_mode = noallocate;
 }
 
+/* Set/unset batch free mode.
+ * Blocks freed in this mode are checked and released together on unset.
+ */
+void set_batch_free_mode(bool batch_free)
+{
+    if (batch_mode && !batch_free)
+        batch_release();
+    batch_mode = batch_free;
+}
+
 /* Return whether any errors have occurred since last time set error limit */
 bool error_check()
 {
@@ -266,18 +577,35 @@ bool error_check()
     return e;
 }
 
+/* Make SIGALRM be delivered once the given time has elapsed */
+static void watchdog_arm(int64_t ns)
+{
+    int64_t us = ns / 1000 + 1;
+    struct itimerval it = {
+        .it_value.tv_sec = us / 1000000,
+        .it_value.tv_usec = us % 1000000,
+    };
+    watchdog_expiry = time_ns() + us * 1000;
+    watchdog_pending = true;
+    setitimer(ITIMER_REAL, &it, NULL);
+}
+
 /* Prepare for a risky operation using setjmp.
  * Function returns true for initial return, false for error return
  */
 bool exception_setup(bool limit_time)
 {
-    if (sigsetjmp(env, 1)) {
+    /* Not saving the signal mask spares a system call on every operation */
+    if (sigsetjmp(env, 0)) {
         /* Got here from longjmp */
         jmp_ready = false;
-        if (time_limited) {
-            alarm(0);
-            time_limited = false;
-        }
+        time_limited = false;
+
+        /* We left the SIGALRM handler without the mask being restored */
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGALRM);
+        sigprocmask(SIG_UNBLOCK, &mask, NULL);
 
         if (error_message)
             report_event(MSG_ERROR, error_message);
@@ -288,8 +616,10 @@ bool exception_setup(bool limit_time)
     /* Got here from initial call */
     jmp_ready = true;
     if (limit_time) {
-        alarm(time_limit);
+        deadline = time_ns() + (int64_t) time_limit * 1000000000;
         time_limited = true;
+        if (!watchdog_pending || deadline < watchdog_expiry)
+            watchdog_arm((int64_t) time_limit * 1000000000);
     }
     return true;
 }
@@ -297,15 +627,28 @@ bool exception_setup(bool limit_time)
 /* Call once past risky code */
 void exception_cancel()
 {
-    if (time_limited) {
-        alarm(0);
-        time_limited = false;
-    }
-
+    time_limited = false;
     jmp_ready = false;
     error_message = "";
 }
 
+/* Called upon SIGALRM.  Return whether the operation in progress has
+ * exceeded its time limit, otherwise rearm the watchdog if still needed.
+ */
+bool time_limit_exceeded()
+{
+    watchdog_pending = false;
+    if (!time_limited)
+        return false;
+
+    int64_t left = deadline - time_ns();
+    if (left <= 0)
+        return true;
+
+    watchdog_arm(left);
+    return false;
+}
+
 /* Use longjmp to return to most recent exception setup */
 void trigger_exception(char *msg)
 {
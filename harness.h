@@ -21,9 +21,32 @@ char *test_strdup(const char *s);
 /* Report number of allocated blocks */
 size_t allocation_check();
 
+/* Print allocated blocks grouped by allocation site and size, most bytes
+ * first.  Sites are only known for blocks allocated with record_sites set.
+ */
+void leak_report(int vlevel);
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/*
+ * Guard mode, enabled when nonzero.
+ * In this mode, each block ends at an inaccessible page, so that overruns
+ * fault immediately, and freed blocks are kept inaccessible for a while to
+ * catch use after free.  Blocks are far more expensive, so perf traces
+ * should leave it off.
+ */
+extern int guard_mode;
+
+/*
+ * Record the caller of malloc, calloc and strdup for every block when
+ * nonzero, so that leaks can be attributed to where they were allocated.
+ */
+extern int record_sites;
+
+/* Seconds a queue operation may take before it is interrupted */
+extern int time_limit;
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
@@ -36,6 +59,14 @@ void set_cautious_mode(bool cautious);
  */
 void set_noallocate_mode(bool noallocate);
 
+/*
+ * Set/unset batch free mode.
+ * In this mode, calls to free check and fill blocks as released, but leave
+ * them allocated until the mode is unset, which then releases all of them.
+ * Freeing a big queue stays linear even in cautious mode.
+ */
+void set_batch_free_mode(bool batch_free);
+
 /* Return whether any errors have occurred since last time checked */
 bool error_check();
 
@@ -47,6 +78,11 @@ bool exception_setup(bool limit_time);
 /* Call once past risky code */
 void exception_cancel();
 
+/* Call from SIGALRM handler.
+ * Return true if the risky operation in progress has run out of time
+ */
+bool time_limit_exceeded();
+
 /* Use longjmp to return to most recent exception setup.  Include error message
  */
 void trigger_exception(char *msg);
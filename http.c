@@ -0,0 +1,295 @@
+/* Incremental parser of HTTP requests, for the built-in web server */
+
+#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include "http.h"
+
+#define MAXTOKEN 16 /* longest method or version */
+#define MAXLENGTH ((size_t) 1 << 40)
+
+enum {
+    S_METHOD,
+    S_URI_START,
+    S_URI,
+    S_VERSION,
+    S_LF, /* '\n' after '\r' ending the request line */
+    S_HEADER_START,
+    S_NAME,
+    S_VALUE_START,
+    S_VALUE,
+    S_END_LF, /* '\n' after '\r' ending the headers */
+};
+
+/* Words recognized, once a whole token is there to compare */
+static const char *const methods[] = {"GET", "POST"};
+static const char *const headers[] = {"connection", "content-length",
+                                       "transfer-encoding"};
+static const char *const connections[] = {"close", "keep-alive"};
+
+#define N_WORDS(words) (int) (sizeof(words) / sizeof(words[0]))
+
+enum { H_CONNECTION, H_CONTENT_LENGTH, H_TRANSFER_ENCODING };
+
+/* Index of word equal to the len bytes of s, -1 if none */
+static int lookup(const char *const *words,
+                  int n,
+                  const char *s,
+                  size_t len,
+                  bool fold)
+{
+    for (int i = 0; i < n; i++) {
+        if (strlen(words[i]) != len)
+            continue;
+        if (fold ? !strncasecmp(words[i], s, len) : !memcmp(words[i], s, len))
+            return i;
+    }
+    return -1;
+}
+
+void http_init(http_parser_t *p)
+{
+    p->method = HTTP_OTHER;
+    p->uri = p->uri_len = 0;
+    p->keep_alive = false;
+    p->content_length = 0;
+    p->chunked = false;
+    p->pos = 0;
+    p->state = S_METHOD;
+    p->mark = 0;
+    p->header = -1;
+    p->http10 = false;
+    p->has_connection = false;
+}
+
+/* Position of first space, control character or stop from pos */
+static size_t skip_token(const char *buf, size_t pos, size_t len, char stop)
+{
+    while (pos < len) {
+        unsigned char c = buf[pos];
+        if (c <= ' ' || c == 0x7f || c == stop)
+            break;
+        pos++;
+    }
+    return pos;
+}
+
+/* Take what a header line says, with value of len bytes */
+static bool end_header(http_parser_t *p, const char *value, size_t len)
+{
+    while (len && (value[len - 1] == ' ' || value[len - 1] == '\t' ||
+                   value[len - 1] == '\r'))
+        len--;
+
+    if (p->header == H_CONNECTION) {
+        int i = lookup(connections, N_WORDS(connections), value, len, true);
+        if (i >= 0) {
+            p->keep_alive = i == 1;
+            p->has_connection = true;
+        }
+    } else if (p->header == H_CONTENT_LENGTH) {
+        if (!len)
+            return false;
+        p->content_length = 0;
+        for (size_t i = 0; i < len; i++) {
+            if (value[i] < '0' || value[i] > '9')
+                return false;
+            p->content_length = 10 * p->content_length + value[i] - '0';
+            if (p->content_length > MAXLENGTH)
+                return false;
+        }
+    } else if (p->header == H_TRANSFER_ENCODING) {
+        /* Whatever the coding, the body is not delimited by its length */
+        p->chunked = true;
+    }
+    return true;
+}
+
+static http_status_t done(http_parser_t *p)
+{
+    if (!p->has_connection)
+        p->keep_alive = !p->http10;
+    return HTTP_DONE;
+}
+
+/* Tokens are scanned in one go, and only looked at as a whole once they are
+ * complete, which is fine since all of the request stays in the buffer.
+ */
+http_status_t http_parse(http_parser_t *p, const char *buf, size_t len)
+{
+    while (p->pos < len) {
+        int c = (unsigned char) buf[p->pos];
+
+        switch (p->state) {
+        case S_METHOD:
+            p->pos = skip_token(buf, p->pos, len, ' ');
+            if (p->pos - p->mark > MAXTOKEN)
+                return HTTP_ERROR;
+            if (p->pos == len)
+                break;
+            if (buf[p->pos] != ' ' || p->pos == p->mark)
+                return HTTP_ERROR;
+            int i = lookup(methods, N_WORDS(methods), buf + p->mark,
+                           p->pos - p->mark, false);
+            p->method = i < 0 ? HTTP_OTHER : (http_method_t) i;
+            p->state = S_URI_START;
+            p->pos++;
+            break;
+        case S_URI_START:
+            if (c == ' ') {
+                p->pos++;
+                break;
+            }
+            if (c < ' ' || c == 0x7f)
+                return HTTP_ERROR;
+            p->uri = p->pos;
+            p->state = S_URI;
+            /* fall through */
+        case S_URI:
+            p->pos = skip_token(buf, p->pos, len, ' ');
+            if (p->pos == len)
+                break;
+            c = (unsigned char) buf[p->pos++];
+            p->uri_len = p->pos - 1 - p->uri;
+            if (c == ' ') {
+                p->mark = p->pos;
+                p->state = S_VERSION;
+            } else if (c == '\r' || c == '\n') {
+                /* No version at all is HTTP/0.9 */
+                p->http10 = true;
+                p->state = c == '\r' ? S_LF : S_HEADER_START;
+            } else {
+                return HTTP_ERROR;
+            }
+            break;
+        case S_VERSION:
+            p->pos = skip_token(buf, p->pos, len, 0);
+            if (p->pos - p->mark > MAXTOKEN)
+                return HTTP_ERROR;
+            if (p->pos == len)
+                break;
+            c = (unsigned char) buf[p->pos++];
+            if (c != '\r' && c != '\n')
+                return HTTP_ERROR;
+            p->http10 = p->pos - 1 - p->mark == 8 &&
+                        !memcmp(buf + p->mark, "HTTP/1.0", 8);
+            p->state = c == '\r' ? S_LF : S_HEADER_START;
+            break;
+        case S_LF:
+            if (c != '\n')
+                return HTTP_ERROR;
+            p->pos++;
+            p->state = S_HEADER_START;
+            break;
+        case S_HEADER_START:
+            p->pos++;
+            if (c == '\r') {
+                p->state = S_END_LF;
+                break;
+            }
+            if (c == '\n')
+                return done(p);
+            p->mark = p->pos - 1;
+            p->state = S_NAME;
+            /* fall through */
+        case S_NAME:
+            p->pos = skip_token(buf, p->pos, len, ':');
+            if (p->pos == len)
+                break;
+            if (buf[p->pos] != ':' || p->pos == p->mark)
+                return HTTP_ERROR;
+            p->header = lookup(headers, N_WORDS(headers), buf + p->mark,
+                               p->pos - p->mark, true);
+            p->pos++;
+            p->state = S_VALUE_START;
+            break;
+        case S_VALUE_START:
+            if (c == ' ' || c == '\t') {
+                p->pos++;
+                break;
+            }
+            p->mark = p->pos;
+            p->state = S_VALUE;
+            /* fall through */
+        case S_VALUE: {
+            const char *eol = memchr(buf + p->pos, '\n', len - p->pos);
+            if (!eol) {
+                p->pos = len;
+                break;
+            }
+            p->pos = eol - buf + 1;
+            if (!end_header(p, buf + p->mark, eol - buf - p->mark))
+                return HTTP_ERROR;
+            p->state = S_HEADER_START;
+            break;
+        }
+        case S_END_LF:
+            if (c != '\n')
+                return HTTP_ERROR;
+            p->pos++;
+            return done(p);
+        }
+    }
+    return HTTP_AGAIN;
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c = tolower((unsigned char) c);
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+bool http_decode_uri(const char *uri, size_t len, char *dest, size_t size)
+{
+    const char *end = uri + len;
+    size_t n = 0;
+
+    if (!size)
+        return false;
+    if (uri < end && *uri == '/')
+        uri++;
+    for (; uri < end && *uri != '?'; uri++) {
+        char c = *uri;
+        if (c == '%') {
+            int hi, lo;
+            if (end - uri < 3 || (hi = hex_value(uri[1])) < 0 ||
+                (lo = hex_value(uri[2])) < 0 || !(hi | lo))
+                return false;
+            c = (char) (hi << 4 | lo);
+            uri += 2;
+        }
+        if (c == '/')
+            c = ' ';
+        if (n + 1 >= size)
+            return false;
+        dest[n++] = c;
+    }
+    dest[n] = '\0';
+    return true;
+}
+
+bool http_query_has(const char *uri, size_t len, const char *name)
+{
+    const char *end = uri + len;
+    const char *param = memchr(uri, '?', len);
+    size_t name_len = strlen(name);
+
+    while (param && param < end) {
+        param++;
+        const char *next = memchr(param, '&', end - param);
+        const char *stop = next ? next : end;
+        const char *eq = memchr(param, '=', stop - param);
+        const char *key_end = eq ? eq : stop;
+        if ((size_t) (key_end - param) == name_len &&
+            !memcmp(param, name, name_len))
+            return true;
+        param = next;
+    }
+    return false;
+}
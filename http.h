@@ -0,0 +1,59 @@
+#ifndef LAB0_HTTP_H
+#define LAB0_HTTP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Incremental parser of HTTP request headers.
+ * It is fed the bytes of a connection as they arrive, and keeps its state in
+ * between, so that what was parsed is not scanned again, however the request
+ * is split into reads.  Nothing is allocated or copied: the request is kept in
+ * the caller's buffer until it is complete, and parts of it are located by
+ * their offset from its start.
+ */
+
+typedef enum {
+    HTTP_GET,
+    HTTP_POST,
+    HTTP_OTHER,
+} http_method_t;
+
+typedef enum {
+    HTTP_AGAIN, /* need more input */
+    HTTP_DONE,  /* headers complete */
+    HTTP_ERROR, /* malformed request */
+} http_status_t;
+
+typedef struct {
+    /* Results, once done */
+    http_method_t method;
+    size_t uri, uri_len;   /* position of URI from start of request */
+    bool keep_alive;       /* connection persists after response */
+    size_t content_length; /* of body */
+    bool chunked;          /* body with a transfer coding, not supported */
+    size_t pos;            /* bytes parsed, length of headers once done */
+
+    /* Progress */
+    int state;
+    size_t mark; /* start of method, version, header name or value */
+    int header;  /* known header of the line, -1 if none */
+    bool http10;
+    bool has_connection;
+} http_parser_t;
+
+/* Start parsing a new request */
+void http_init(http_parser_t *p);
+
+/* Parse more of the request starting at buf, of which len bytes are there */
+http_status_t http_parse(http_parser_t *p, const char *buf, size_t len);
+
+/* Decode URI path of len bytes, without the leading '/' and any query, into
+ * dest of size bytes.  Separators '/' become spaces, so that the path reads
+ * as a command line.  False if an escape is malformed or dest too small.
+ */
+bool http_decode_uri(const char *uri, size_t len, char *dest, size_t size);
+
+/* Whether query of URI of len bytes has parameter name, with any value */
+bool http_query_has(const char *uri, size_t len, const char *name);
+
+#endif /* LAB0_HTTP_H */
@@ -0,0 +1,137 @@
+/* Streaming writer of JSON, for machine-readable output */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "json.h"
+
+void json_init(json_t *j, json_sink_t write, void *ctx)
+{
+    j->write = write;
+    j->ctx = ctx;
+    j->first = true;
+}
+
+static void put(json_t *j, const char *s)
+{
+    j->write(j->ctx, s, strlen(s));
+}
+
+/* Separate value from the previous one, if any */
+static void separate(json_t *j)
+{
+    if (!j->first)
+        j->write(j->ctx, ",", 1);
+    j->first = false;
+}
+
+void json_object_begin(json_t *j)
+{
+    separate(j);
+    put(j, "{");
+    j->first = true;
+}
+
+void json_object_end(json_t *j)
+{
+    put(j, "}");
+    j->first = false;
+}
+
+void json_array_begin(json_t *j)
+{
+    separate(j);
+    put(j, "[");
+    j->first = true;
+}
+
+void json_array_end(json_t *j)
+{
+    put(j, "]");
+    j->first = false;
+}
+
+void json_key(json_t *j, const char *key)
+{
+    json_string(j, key);
+    put(j, ":");
+    /* The value goes with it */
+    j->first = true;
+}
+
+void json_string_begin(json_t *j)
+{
+    separate(j);
+    put(j, "\"");
+}
+
+/* Runs of characters needing no escape are written as they are */
+void json_string_part(json_t *j, const char *s, size_t len)
+{
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (c >= ' ' && c != '"' && c != '\\')
+            continue;
+        if (i > start)
+            j->write(j->ctx, s + start, i - start);
+        start = i + 1;
+
+        char esc[8];
+        switch (c) {
+        case '"':
+            put(j, "\\\"");
+            break;
+        case '\\':
+            put(j, "\\\\");
+            break;
+        case '\n':
+            put(j, "\\n");
+            break;
+        case '\r':
+            put(j, "\\r");
+            break;
+        case '\t':
+            put(j, "\\t");
+            break;
+        default:
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            put(j, esc);
+        }
+    }
+    if (len > start)
+        j->write(j->ctx, s + start, len - start);
+}
+
+void json_string_end(json_t *j)
+{
+    put(j, "\"");
+}
+
+void json_string(json_t *j, const char *s)
+{
+    json_string_begin(j);
+    json_string_part(j, s, strlen(s));
+    json_string_end(j);
+}
+
+void json_int(json_t *j, int64_t value)
+{
+    char buf[32];
+    separate(j);
+    snprintf(buf, sizeof(buf), "%" PRId64, value);
+    put(j, buf);
+}
+
+void json_bool(json_t *j, bool value)
+{
+    separate(j);
+    put(j, value ? "true" : "false");
+}
+
+void json_null(json_t *j)
+{
+    separate(j);
+    put(j, "null");
+}
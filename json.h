@@ -0,0 +1,43 @@
+#ifndef LAB0_JSON_H
+#define LAB0_JSON_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Streaming writer of JSON.
+ * Text goes to the sink as values are written, strings being escaped on the
+ * way, so that no document is built in memory first.  Commas are put in
+ * between values by the writer.
+ */
+
+typedef void (*json_sink_t)(void *ctx, const char *buf, size_t len);
+
+typedef struct {
+    json_sink_t write;
+    void *ctx;
+    bool first; /* no value yet in the current object or array */
+} json_t;
+
+/* Start writing a value to sink */
+void json_init(json_t *j, json_sink_t write, void *ctx);
+
+void json_object_begin(json_t *j);
+void json_object_end(json_t *j);
+void json_array_begin(json_t *j);
+void json_array_end(json_t *j);
+
+/* Name of the next value of an object */
+void json_key(json_t *j, const char *key);
+
+void json_string(json_t *j, const char *s);
+void json_int(json_t *j, int64_t value);
+void json_bool(json_t *j, bool value);
+void json_null(json_t *j);
+
+/* String given in parts of len bytes, as it comes */
+void json_string_begin(json_t *j);
+void json_string_part(json_t *j, const char *s, size_t len);
+void json_string_end(json_t *j);
+
+#endif /* LAB0_JSON_H */
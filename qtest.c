@@ -5,6 +5,7 @@
 #include <getopt.h>
 #include <signal.h>
 #include <spawn.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -47,6 +48,7 @@ extern int show_entropy;
 
 #include "console.h"
 #include "report.h"
+#include "web.h"
 
 /* Settable parameters */
 
@@ -54,7 +56,7 @@ extern int show_entropy;
 
 /* How large is a queue before it's considered big.
  * This affects how it gets printed
- * and whether cautious mode is used when freeing the queue
+ * and whether its blocks are released in a batch when freeing the queue
  */
 #define BIG_LIST_SIZE 30
 
@@ -68,6 +70,13 @@ typedef struct {
 static queue_chain_t chain = {.size = 0};
 static queue_contex_t *current = NULL;
 
+/* Queues indexed by ID, so that any of them is selected without walking the
+ * chain.  IDs are not reused, and entries of freed queues are NULL.
+ */
+static queue_contex_t **queue_index = NULL;
+static int queue_index_size = 0;
+static int next_id = 0;
+
 /* How many times can queue operations fail */
 static int fail_limit = BIG_LIST_SIZE;
 static int fail_count = 0;
@@ -76,6 +85,15 @@ static int string_length = MAXSTRING;
 
 static int descend = 0;
 
+/* Check that the queue is doubly circular whenever it is shown.  When not
+ * set, only 'show' does, and showing the queue after each command visits
+ * just the elements displayed.
+ */
+static int check_queue = 1;
+
+/* When set, big queues are shown as this many elements from each end */
+static int show_window = 0;
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
@@ -87,6 +105,33 @@ typedef enum {
 /* Forward declarations */
 static bool q_show(int vlevel);
 
+static bool index_add(queue_contex_t *qctx)
+{
+    if (qctx->id >= queue_index_size) {
+        int size = queue_index_size ? 2 * queue_index_size : 64;
+        queue_contex_t **index =
+            realloc(queue_index, size * sizeof(queue_contex_t *));
+        if (!index)
+            return false;
+        memset(index + queue_index_size, 0,
+               (size - queue_index_size) * sizeof(queue_contex_t *));
+        queue_index = index;
+        queue_index_size = size;
+    }
+    queue_index[qctx->id] = qctx;
+    return true;
+}
+
+static void index_remove(queue_contex_t *qctx)
+{
+    queue_index[qctx->id] = NULL;
+}
+
+static queue_contex_t *index_find(int id)
+{
+    return id >= 0 && id < queue_index_size ? queue_index[id] : NULL;
+}
+
 static bool do_free(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -103,7 +148,7 @@ static bool do_free(int argc, char *argv[])
     error_check();
 
     if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
+        set_batch_free_mode(true);
 
     struct list_head *qnext = NULL;
     if (chain.size > 1) {
@@ -117,10 +162,11 @@ static bool do_free(int argc, char *argv[])
         if (exception_setup(true))
             q_free(current->q);
         exception_cancel();
-        set_cautious_mode(true);
+        set_batch_free_mode(false);
     }
 
     if (current) {
+        index_remove(current);
         free(current);
         chain.size--;
         current = qnext ? list_entry(qnext, queue_contex_t, chain) : NULL;
@@ -133,6 +179,7 @@ static bool do_free(int argc, char *argv[])
         report(1,
                "ERROR: There is no queue, but %lu blocks are still allocated",
                bcnt);
+        leak_report(1);
         ok = false;
     }
 
@@ -154,7 +201,10 @@ static bool do_new(int argc, char *argv[])
 
         qctx->size = 0;
         qctx->q = q_new();
-        qctx->id = chain.size++;
+        qctx->id = next_id++;
+        chain.size++;
+        if (!index_add(qctx))
+            report(1, "WARNING: Queue %d cannot be selected by ID", qctx->id);
 
         current = qctx;
     }
@@ -986,6 +1036,7 @@ static bool do_merge(int argc, char *argv[])
             queue_contex_t *ctx = list_entry(cur, queue_contex_t, chain);
             cur = cur->next;
             q_free(ctx->q);
+            index_remove(ctx);
             free(ctx);
         }
 
@@ -1098,28 +1149,45 @@ static bool do_shuffle(int argc, char *argv[])
     return !error_check();
 }
 
-static bool is_circular()
+/* Line showing the queue, built up before being reported as a whole */
+static char *show_buf = NULL;
+static size_t show_len = 0;
+static size_t show_size = 0;
+
+/* Return false if the line could not be grown to hold it */
+static bool show_append(const char *fmt, ...)
 {
-    struct list_head *cur = current->q->next;
-    struct list_head *fast = (cur) ? cur->next : NULL;
-    while (cur != current->q) {
-        if (!cur || !fast || !fast->next)
+    for (;;) {
+        va_list ap;
+        size_t room = show_size - show_len;
+        va_start(ap, fmt);
+        int n = vsnprintf(show_buf + show_len, room, fmt, ap);
+        va_end(ap);
+        if (n < 0)
             return false;
-        if (cur == fast)
-            return false;
-        cur = cur->next;
-        fast = fast->next->next;
-    }
+        if ((size_t) n < room) {
+            show_len += n;
+            return true;
+        }
 
-    cur = current->q->prev;
-    fast = (cur) ? cur->prev : NULL;
-    while (cur != current->q) {
-        if (!cur || !fast || !fast->prev)
+        size_t size = show_size ? 2 * show_size : 1024;
+        while (size <= show_len + n)
+            size *= 2;
+        char *buf = realloc(show_buf, size);
+        if (!buf)
             return false;
-        cur = cur->prev;
-        fast = fast->prev->prev;
+        show_buf = buf;
+        show_size = size;
     }
-    return true;
+}
+
+static bool show_element(struct list_head *node, bool first)
+{
+    element_t *e = list_entry(node, element_t, list);
+    return show_append(first ? "%s" : " %s", e->value) &&
+           (!show_entropy ||
+            show_append("(%3.2f%%)",
+                        shannon_entropy((const uint8_t *) e->value)));
 }
 
 static bool q_show(int vlevel)
@@ -1134,54 +1202,133 @@ static bool q_show(int vlevel)
         return true;
     }
 
-    if (!is_circular()) {
-        report(vlevel, "ERROR:  Queue is not doubly circular");
-        return false;
-    }
+    /* Showing the queue explicitly always checks all of it */
+    bool check = check_queue || vlevel == 0;
+    bool circular = true;
+
+    int size = current->size;
+    bool windowed = show_window > 0 && size > 2 * show_window;
+    int shown = windowed ? show_window : BIG_LIST_SIZE;
+    /* Unless checking, only the elements shown are visited */
+    int limit = check ? size : shown < size ? shown : size;
 
-    report_noreturn(vlevel, "l = [");
+    show_len = 0;
+    bool appended = show_append("l = [");
 
     struct list_head *ori = current->q;
+    struct list_head *prev = ori;
     struct list_head *cur = current->q->next;
 
     if (exception_setup(true)) {
-        while (ok && ori != cur && cnt < current->size) {
-            element_t *e = list_entry(cur, element_t, list);
-            if (cnt < BIG_LIST_SIZE) {
-                report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", e->value);
-                if (show_entropy) {
-                    report_noreturn(
-                        vlevel, "(%3.2f%%)",
-                        shannon_entropy((const uint8_t *) e->value));
-                }
+        /* Checked in the same pass: each element must link back to the one
+         * before it, which also keeps the walk from entering a cycle that
+         * does not go through the head.
+         */
+        while (ok && appended && ori != cur && cnt < limit) {
+            if (check && (!cur || cur->prev != prev)) {
+                circular = false;
+                break;
             }
+            if (cnt < shown && !(appended = show_element(cur, cnt == 0)))
+                break;
             cnt++;
+            prev = cur;
             cur = cur->next;
             ok = ok && !error_check();
         }
+        if (check && ok && appended && cur == ori && ori->prev != prev)
+            circular = false;
+
+        /* Not if the queue just turned out to be longer than its size */
+        if (ok && appended && circular && windowed &&
+            (cur == ori || cnt < size)) {
+            appended = show_append(" ...");
+            struct list_head *tail = ori;
+            for (int i = 0; i < show_window; i++)
+                tail = tail->prev;
+            for (int i = 0; ok && appended && i < show_window; i++) {
+                appended = show_element(tail, false);
+                tail = tail->next;
+                ok = !error_check();
+            }
+        }
     }
     exception_cancel();
 
+    if (!appended) {
+        report(vlevel, "ERROR:  Could not allocate memory to show queue");
+        return false;
+    }
+
+    if (!circular) {
+        report(vlevel, "ERROR:  Queue is not doubly circular");
+        return false;
+    }
+
     if (!ok) {
-        report(vlevel, " ... ]");
+        report(vlevel, "%s ... ]", show_buf);
         return false;
     }
 
-    if (cur == ori) {
-        if (cnt <= BIG_LIST_SIZE)
-            report(vlevel, "]");
-        else
-            report(vlevel, " ... ]");
-    } else {
-        report(vlevel, " ... ]");
+    if (cur != ori && cnt == size) {
+        report(vlevel, "%s ... ]", show_buf);
         report(vlevel, "ERROR:  Queue has more than %d elements",
                current->size);
         ok = false;
+    } else if (windowed || (cur == ori && cnt <= BIG_LIST_SIZE)) {
+        report(vlevel, "%s]", show_buf);
+    } else {
+        report(vlevel, "%s ... ]", show_buf);
     }
 
     return ok;
 }
 
+/* Metrics of the queues, for the web server */
+static void q_metrics()
+{
+    long elements = 0;
+    queue_contex_t *ctx;
+    list_for_each_entry(ctx, &chain.head, chain)
+        elements += ctx->size;
+
+    web_metric_help("qtest_queues", "gauge", "Queues in the chain");
+    web_metric("qtest_queues", NULL, chain.size);
+    web_metric_help("qtest_elements", "gauge", "Elements in all queues");
+    web_metric("qtest_elements", NULL, elements);
+}
+
+/* State of the queues in JSON responses to web clients.  The walk over the
+ * contents stops after as many elements as the queue should have, in case it
+ * is broken.
+ */
+static void q_json(json_t *j, bool contents)
+{
+    json_key(j, "queues");
+    json_int(j, chain.size);
+    json_key(j, "size");
+    if (!current || !current->q) {
+        json_null(j);
+        return;
+    }
+    json_int(j, current->size);
+    if (!contents)
+        return;
+
+    json_key(j, "queue");
+    json_array_begin(j);
+    struct list_head *cur = current->q->next;
+    for (int i = 0; i < current->size && cur != current->q; i++) {
+        element_t *e = list_entry(cur, element_t, list);
+        if (e->value)
+            json_string(j, e->value);
+        else
+            json_null(j);
+        cur = cur->next;
+    }
+    json_array_end(j);
+}
+
 static bool do_show(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -1241,12 +1388,44 @@ static bool do_next(int argc, char *argv[])
     return q_show(0);
 }
 
+static bool do_select(int argc, char *argv[])
+{
+    int id;
+    if (argc < 2 || !get_int(argv[1], &id)) {
+        report(1, "Use 'select <id>', or 'select <id> <cmd> [args]' to run "
+                  "one command on queue <id>");
+        return false;
+    }
+
+    queue_contex_t *qctx = index_find(id);
+    if (!qctx) {
+        report(1, "No queue with ID %d", id);
+        return false;
+    }
+
+    if (argc == 2) {
+        current = qctx;
+        return q_show(0);
+    }
+
+    /* Command may free the queue that was current before */
+    int saved_id = current ? current->id : -1;
+    current = qctx;
+    bool ok = interpret_cmda(argc - 2, argv + 2);
+    if (index_find(saved_id))
+        current = index_find(saved_id);
+    return ok;
+}
+
 static void console_init()
 {
     ADD_COMMAND(new, "Create new queue", "");
     ADD_COMMAND(free, "Delete queue", "");
     ADD_COMMAND(prev, "Switch to previous queue", "");
     ADD_COMMAND(next, "Switch to next queue", "");
+    ADD_COMMAND(select,
+                "Switch to queue with ID id, or run cmd on it and switch back",
+                "id [cmd arg ...]");
     ADD_COMMAND(ih,
                 "Insert string str at head of queue n times. Generate random "
                 "string(s) if str equals RAND. (default: n == 1)",
@@ -1289,8 +1468,22 @@ static void console_init()
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
+    add_param("guard", &guard_mode,
+              "Catch overruns and use after free with guard pages (turned "
+              "off once out of mappings, after about 16k elements)",
+              NULL);
+    add_param("sites", &record_sites,
+              "Record allocation sites to attribute leaked blocks", NULL);
+    add_param("time", &time_limit,
+              "Maximum seconds a queue operation may take", NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
+    add_param("check", &check_queue,
+              "Check queue is doubly circular after each command (0: only "
+              "on show)",
+              NULL);
+    add_param("window", &show_window,
+              "Show this many elements from each end of big queues", NULL);
     add_param("descend", &descend,
               "Sort and merge queue in ascending/descending order", NULL);
 }
@@ -1298,6 +1491,11 @@ static void console_init()
 /* Signal handlers */
 static void sigsegv_handler(int sig)
 {
+    /* Output of the commands before is buffered when running a trace.  The
+     * fault comes from queue code, never from within stdio, so that flushing
+     * it is safe here, while abort() would discard it.
+     */
+    flush_output();
     /* Avoid possible non-reentrant signal function be used in signal handler */
     assert(write(1,
                  "Segmentation fault occurred.  You dereferenced a NULL or "
@@ -1309,6 +1507,8 @@ static void sigsegv_handler(int sig)
 
 static void sigalrm_handler(int sig)
 {
+    if (!time_limit_exceeded())
+        return;
     trigger_exception(
         "Time limit exceeded.  Either you are in an infinite loop, or your "
         "code is too inefficient");
@@ -1326,7 +1526,7 @@ static bool q_quit(int argc, char *argv[])
 {
     report(3, "Freeing queue");
     if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
+        set_batch_free_mode(true);
 
     if (exception_setup(true)) {
         struct list_head *cur = chain.head.next;
@@ -1338,14 +1538,21 @@ static bool q_quit(int argc, char *argv[])
             chain.size--;
         }
     }
+    free(queue_index);
+    queue_index = NULL;
+    queue_index_size = 0;
+    free(show_buf);
+    show_buf = NULL;
+    show_len = show_size = 0;
 
     exception_cancel();
-    set_cautious_mode(true);
+    set_batch_free_mode(false);
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
         report(1, "ERROR: Freed queue, but %lu blocks are still allocated",
                bcnt);
+        leak_report(1);
         return false;
     }
 
@@ -1625,12 +1832,17 @@ int main(int argc, char *argv[])
         set_logfile(logfile_name);
 
     add_quit_helper(q_quit);
+    web_set_state(q_json);
+    web_add_metrics(cmd_metrics);
+    web_add_metrics(q_metrics);
+    web_add_metrics(memory_metrics);
 
     bool ok = true;
     ok = ok && run_console(infile_name);
 
     /* Do finish_cmd() before check whether ok is true or false */
     ok = finish_cmd() && ok;
+    report_memory_usage(2);
 
     return !ok;
 }
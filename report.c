@@ -25,6 +25,49 @@ static void init_files(FILE *efile, FILE *vfile)
     verbfile = vfile;
 }
 
+/* Output is normally flushed after every report.  When buffered, it is only
+ * flushed once OUTPUT_BUFSIZE bytes are pending or OUTPUT_FLUSH_NS after the
+ * previous flush, so that a stream of commands is not slowed down by a write
+ * per line.
+ */
+#define OUTPUT_BUFSIZE (1 << 20)
+#define OUTPUT_FLUSH_NS 100000000
+static char output_buf[OUTPUT_BUFSIZE];
+static bool output_buffered = false;
+static int64_t last_flush = 0;
+
+void set_output_buffering(bool buffered)
+{
+    if (!verbfile)
+        init_files(stdout, stdout);
+
+    fflush(verbfile);
+    if (buffered && !output_buffered)
+        setvbuf(verbfile, output_buf, _IOFBF, OUTPUT_BUFSIZE);
+    output_buffered = buffered;
+    last_flush = time_ns();
+}
+
+void flush_output()
+{
+    if (verbfile)
+        fflush(verbfile);
+}
+
+static void flush_verbfile()
+{
+    if (!output_buffered) {
+        fflush(verbfile);
+        return;
+    }
+
+    int64_t now = time_ns();
+    if (now - last_flush >= OUTPUT_FLUSH_NS) {
+        fflush(verbfile);
+        last_flush = now;
+    }
+}
+
 static char fail_buf[1024] = "FATAL Error.  Exiting\n";
 
 static volatile int ret = 0;
@@ -108,7 +151,7 @@ void report(int level, char *fmt, ...)
         va_start(ap, fmt);
         vfprintf(verbfile, fmt, ap);
         fprintf(verbfile, "\n");
-        fflush(verbfile);
+        flush_verbfile();
         va_end(ap);
 
         if (logfile) {
@@ -118,19 +161,29 @@ void report(int level, char *fmt, ...)
             fflush(logfile);
             va_end(ap);
         }
-        va_start(ap, fmt);
-        vsnprintf(buffer, BUF_SIZE, fmt, ap);
-        va_end(ap);
-    }
-    if (web_connfd) {
-        int len = strlen(buffer);
-        buffer[len] = '\n';
-        buffer[len + 1] = '\0';
-        web_send(web_connfd, buffer);
-        if (write(web_connfd, "\0", 1) == -1)
-            perror("write");
-        close(web_connfd);
-        web_connfd = 0;
+
+        if (web_connfd) {
+            va_start(ap, fmt);
+            int len = vsnprintf(buffer, BUF_SIZE - 1, fmt, ap);
+            va_end(ap);
+            /* Long lines, such as big queues, are sent whole */
+            char *line = buffer;
+            if (len > BUF_SIZE - 2 && (line = malloc(len + 2))) {
+                va_start(ap, fmt);
+                vsnprintf(line, len + 1, fmt, ap);
+                va_end(ap);
+            } else if (!line) {
+                line = buffer;
+                len = BUF_SIZE - 2;
+            }
+            if (len < 0)
+                len = 0;
+            line[len] = '\n';
+            line[len + 1] = '\0';
+            web_send(web_connfd, line);
+            if (line != buffer)
+                free(line);
+        }
     }
 }
 
@@ -144,7 +197,7 @@ void report_noreturn(int level, char *fmt, ...)
         va_list ap;
         va_start(ap, fmt);
         vfprintf(verbfile, fmt, ap);
-        fflush(verbfile);
+        flush_verbfile();
         va_end(ap);
 
         if (logfile) {
@@ -153,13 +206,14 @@ void report_noreturn(int level, char *fmt, ...)
             fflush(logfile);
             va_end(ap);
         }
-        va_start(ap, fmt);
-        vsnprintf(buffer, BUF_SIZE, fmt, ap);
-        va_end(ap);
-    }
 
-    if (web_connfd)
-        web_send(web_connfd, buffer);
+        if (web_connfd) {
+            va_start(ap, fmt);
+            vsnprintf(buffer, BUF_SIZE, fmt, ap);
+            va_end(ap);
+            web_send(web_connfd, buffer);
+        }
+    }
 }
 
 /* Functions denoting failures */
@@ -170,7 +224,8 @@ static void fail_fun(const char *format, const char *msg)
     snprintf(fail_buf, sizeof(fail_buf), format, msg);
     /* Tack on return */
     fail_buf[strlen(fail_buf)] = '\n';
-    /* Use write to avoid any buffering issues */
+    /* Use write to avoid any buffering issues, after what is buffered */
+    flush_output();
     ret = write(STDOUT_FILENO, fail_buf, strlen(fail_buf) + 1);
 
     if (logfile) {
@@ -187,8 +242,11 @@ static void fail_fun(const char *format, const char *msg)
     exit(1);
 }
 
-/* Maximum number of megabytes that application can use (0 = unlimited) */
-static int mblimit = 0;
+/* Maximum number of megabytes that the queue can use (0 = unlimited).
+ * Only blocks of the test harness count against it, so that running out
+ * fails queue operations, while the interpreter keeps working.
+ */
+int mblimit = 0;
 
 /* Keeping track of memory allocation */
 static size_t allocate_cnt = 0;
@@ -200,53 +258,53 @@ static size_t free_bytes = 0;
 static size_t peak_bytes = 0;
 static size_t last_peak_bytes = 0;
 static size_t current_bytes = 0;
+static size_t harness_bytes = 0; /* of them, allocated by the test harness */
 
-static void check_exceed(size_t new_bytes)
+static bool exceeds_limit(size_t new_bytes)
 {
     size_t limit_bytes = (size_t) mblimit << 20;
-    size_t request_bytes = new_bytes + current_bytes;
-    if (mblimit > 0 && request_bytes > limit_bytes) {
-        report_event(MSG_FATAL,
-                     "Exceeded memory limit of %u megabytes with %lu bytes",
-                     mblimit, request_bytes);
-    }
+    return mblimit > 0 && new_bytes + harness_bytes > limit_bytes;
+}
+
+static void account_alloc(size_t bytes)
+{
+    allocate_cnt++;
+    allocate_bytes += bytes;
+    current_bytes += bytes;
+    peak_bytes = MAX(peak_bytes, current_bytes);
+    last_peak_bytes = MAX(last_peak_bytes, current_bytes);
+}
+
+static void account_free(size_t bytes)
+{
+    free_cnt++;
+    free_bytes += bytes;
+    current_bytes -= bytes;
 }
 
 /* Call malloc & exit if fails */
 void *malloc_or_fail(size_t bytes, const char *fun_name)
 {
-    check_exceed(bytes);
     void *p = malloc(bytes);
     if (!p) {
         fail_fun("Malloc returned NULL in %s", fun_name);
         return NULL;
     }
 
-    allocate_cnt++;
-    allocate_bytes += bytes;
-    current_bytes += bytes;
-    peak_bytes = MAX(peak_bytes, current_bytes);
-    last_peak_bytes = MAX(last_peak_bytes, current_bytes);
-
+    account_alloc(bytes);
     return p;
 }
 
 /* Call calloc returns NULL & exit if fails */
 void *calloc_or_fail(size_t cnt, size_t bytes, const char *fun_name)
 {
-    check_exceed(cnt * bytes);
     void *p = calloc(cnt, bytes);
     if (!p) {
         fail_fun("Calloc returned NULL in %s", fun_name);
         return NULL;
     }
 
-    allocate_cnt++;
-    allocate_bytes += cnt * bytes;
-    current_bytes += cnt * bytes;
-    peak_bytes = MAX(peak_bytes, current_bytes);
-    last_peak_bytes = MAX(last_peak_bytes, current_bytes);
-
+    account_alloc(cnt * bytes);
     return p;
 }
 
@@ -256,17 +314,11 @@ char *strsave_or_fail(const char *s, const char *fun_name)
         return NULL;
 
     size_t len = strlen(s);
-    check_exceed(len + 1);
     char *ss = malloc(len + 1);
     if (!ss)
         fail_fun("Failed in %s", fun_name);
 
-    allocate_cnt++;
-    allocate_bytes += len + 1;
-    current_bytes += len + 1;
-    peak_bytes = MAX(peak_bytes, current_bytes);
-    last_peak_bytes = MAX(last_peak_bytes, current_bytes);
-
+    account_alloc(len + 1);
     return strncpy(ss, s, len + 1);
 }
 
@@ -277,9 +329,7 @@ void free_block(void *b, size_t bytes)
         report_event(MSG_ERROR, "Attempting to free null block");
     free(b);
 
-    free_cnt++;
-    free_bytes += bytes;
-    current_bytes -= bytes;
+    account_free(bytes);
 }
 
 /* Free array, as from calloc */
@@ -289,9 +339,7 @@ void free_array(void *b, size_t cnt, size_t bytes)
         report_event(MSG_ERROR, "Attempting to free null block");
     free(b);
 
-    free_cnt++;
-    free_bytes += cnt * bytes;
-    current_bytes -= cnt * bytes;
+    account_free(cnt * bytes);
 }
 
 /* Free string saved by strsave_or_fail */
@@ -302,17 +350,74 @@ void free_string(char *s)
     free_block((void *) s, strlen(s) + 1);
 }
 
+/* Account for memory allocated by others, such as the test harness */
+bool mem_acquire(size_t bytes)
+{
+    if (exceeds_limit(bytes))
+        return false;
+
+    account_alloc(bytes);
+    harness_bytes += bytes;
+    return true;
+}
+
+/* Account for memory released by others */
+void mem_release(size_t bytes)
+{
+    account_free(bytes);
+    harness_bytes -= bytes;
+}
+
+/* Report peak memory usage, both as accounted and as seen by the system */
+void report_memory_usage(int level)
+{
+    struct rusage usage;
+    long maxrss = 0;
+    if (!getrusage(RUSAGE_SELF, &usage)) {
+        maxrss = usage.ru_maxrss;
+#if defined(__APPLE__)
+        maxrss >>= 10; /* reported in bytes rather than kilobytes */
+#endif
+    }
+
+    report(level,
+           "Memory: %zu allocations, %zu bytes at peak, %zu bytes in use, "
+           "%ld KB peak resident",
+           allocate_cnt, peak_bytes, current_bytes, maxrss);
+}
+
+/* Metrics of memory usage, for the web server */
+void memory_metrics()
+{
+    web_metric_help("qtest_allocations_total", "counter", "Blocks allocated");
+    web_metric("qtest_allocations_total", NULL, allocate_cnt);
+    web_metric_help("qtest_frees_total", "counter", "Blocks freed");
+    web_metric("qtest_frees_total", NULL, free_cnt);
+    web_metric_help("qtest_allocated_bytes_total", "counter",
+                    "Bytes allocated");
+    web_metric("qtest_allocated_bytes_total", NULL, allocate_bytes);
+    web_metric_help("qtest_memory_bytes", "gauge", "Bytes in use");
+    web_metric("qtest_memory_bytes", NULL, current_bytes);
+    web_metric_help("qtest_memory_peak_bytes", "gauge", "Bytes in use at peak");
+    web_metric("qtest_memory_peak_bytes", NULL, peak_bytes);
+}
+
 /* Initialization of timers */
 void init_time(double *timep)
 {
     (void) delta_time(timep);
 }
 
+int64_t time_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 double delta_time(double *timep)
 {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    double current_time = tv.tv_sec + 1.0E-6 * tv.tv_usec;
+    double current_time = 1.0E-9 * time_ns();
     double delta = current_time - *timep;
     *timep = current_time;
     return delta;
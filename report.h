@@ -3,6 +3,7 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 /* Ways to report interesting behavior and errors */
 
@@ -26,6 +27,12 @@ void report(int verblevel, char *fmt, ...);
 /* Like report, but without return character */
 void report_noreturn(int verblevel, char *fmt, ...);
 
+/* Buffer output instead of flushing it after every report */
+void set_output_buffering(bool buffered);
+
+/* Write out any buffered output, such as before the program dies */
+void flush_output();
+
 /* Attempt to call malloc.  Fail when returns NULL */
 void *malloc_or_fail(size_t bytes, const char *fun_name);
 
@@ -44,6 +51,26 @@ void free_array(void *b, size_t cnt, size_t bytes);
 /* Free string saved by strsave_or_fail */
 void free_string(char *s);
 
+/* Maximum number of megabytes allocated by the queue (0 = unlimited) */
+extern int mblimit;
+
+/* Account for bytes allocated elsewhere.
+ * Return false, accounting nothing, if that would exceed the memory limit
+ */
+bool mem_acquire(size_t bytes);
+
+/* Account for bytes released elsewhere */
+void mem_release(size_t bytes);
+
+/* Report peak memory usage */
+void report_memory_usage(int level);
+
+/* Write metrics of memory usage, for the web server */
+void memory_metrics();
+
+/* Monotonic time in nanoseconds.  Cheap, as it needs no system call */
+int64_t time_ns();
+
 /* Time counted as fp number in seconds */
 void init_time(double *timep);
 
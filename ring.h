@@ -0,0 +1,58 @@
+#ifndef LAB0_RING_H
+#define LAB0_RING_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/* Rings of commands and of their results, in memory shared between qtest
+ * and a local client.
+ * A client gets one by sending "ring" on the Unix-domain socket of the web
+ * server, which answers "ok" along with three descriptors: the memory, to be
+ * mapped as a ring_t, a non-blocking eventfd to signal new commands, and one
+ * signalled for new results.  The ring lasts as long as the client keeps the
+ * socket open.
+ *
+ * Each ring has a single producer and a single consumer.  Indices only ever
+ * increase, slot i being at i % RING_SLOTS.  The producer fills a slot, then
+ * stores the new tail, and the consumer reads it once it has loaded the tail,
+ * then stores the new head.  Before telling from the index of the other side
+ * whether to signal or to wait, a side follows its store with a full fence.
+ * The client signals commands when it finds qtest done with all the ones
+ * before, and qtest clears the eventfd before looking at the ring, so that it
+ * never waits for a command already there.  Results are signalled at least
+ * every RING_SIGNAL of them, and once no more commands of the client are
+ * queued, the client likewise clearing the eventfd before looking at them.
+ *
+ * There is one result for each command, in the same order.  A client keeps
+ * fewer than RING_SLOTS commands without their result taken, so that neither
+ * ring ever overflows.
+ */
+
+#define RING_SLOTS 1024 /* entries of each ring */
+#define RING_LINE 256   /* longest command, with its length */
+#define RING_OUT 248    /* output kept in a result, the rest is left out */
+#define RING_SIGNAL 16  /* results published before they are signalled */
+
+typedef struct {
+    _Alignas(64) _Atomic uint64_t head; /* taken by consumer */
+    _Alignas(64) _Atomic uint64_t tail; /* put by producer */
+} ring_index_t;
+
+typedef struct {
+    uint32_t len;
+    char line[RING_LINE - sizeof(uint32_t)]; /* not terminated */
+} ring_cmd_t;
+
+typedef struct {
+    uint32_t ok;  /* command succeeded */
+    uint32_t len; /* of the whole output, of which RING_OUT bytes at most */
+    char out[RING_OUT];
+} ring_result_t;
+
+typedef struct {
+    ring_index_t cmds, results;
+    ring_cmd_t cmd[RING_SLOTS];
+    ring_result_t result[RING_SLOTS];
+} ring_t;
+
+#endif /* LAB0_RING_H */
@@ -4,6 +4,10 @@ from __future__ import print_function
 import subprocess
 import sys
 import getopt
+import glob
+import os
+import re
+import difflib
 
 
 
@@ -60,6 +64,19 @@ class Tracer:
 
     maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5]
 
+    # Tests of qtest itself rather than of the queue, run with -s and not
+    # graded.  Each passes if its output matches the .out file next to it.
+    selfTestDict = {
+        1: "self-01-repeat",
+        2: "self-02-journal",
+        3: "self-03-select",
+        4: "self-04-show",
+        5: "self-05-mblimit",
+        6: "self-06-guard",
+        7: "self-07-stats",
+        8: "self-08-time"
+    }
+
     RED = '\033[91m'
     GREEN = '\033[92m'
     WHITE = '\033[0m'
@@ -69,33 +86,71 @@ class Tracer:
                  verbLevel=0,
                  autograde=False,
                  useValgrind=False,
-                 colored=False):
+                 colored=False,
+                 selfTest=False):
         if qtest != "":
             self.qtest = qtest
         self.verbLevel = verbLevel
         self.autograde = autograde
         self.useValgrind = useValgrind
         self.colored = colored
+        self.selfTest = selfTest
+        if selfTest:
+            self.traceDict = self.selfTestDict
 
     def printInColor(self, text, color):
         if self.colored == False:
             color = self.WHITE
         print(color, text, self.WHITE, sep = '')
 
+    # Whether output matches expected lines, where '*' stands for any text
+    def matchOutput(self, output, expected):
+        if len(output) != len(expected):
+            return False
+        for line, pattern in zip(output, expected):
+            regex = ".*".join(re.escape(part) for part in pattern.split("*"))
+            if not re.fullmatch(regex, line):
+                return False
+        return True
+
+    # A trace with a .out file passes if its output at verbosity 1 matches
+    # it, errors included, instead of by the exit status of qtest.  Files it
+    # makes in the trace directory have the process ID ($$) in their name,
+    # and are removed afterwards.
     def runTrace(self, tid):
         if not tid in self.traceDict:
             self.printInColor("ERROR: No trace with id %d" % tid, self.RED)
             return False
         fname = "%s/%s.cmd" % (self.traceDirectory, self.traceDict[tid])
-        vname = "%d" % self.verbLevel
+        oname = "%s/%s.out" % (self.traceDirectory, self.traceDict[tid])
+        checked = os.path.exists(oname)
+        vname = "1" if checked else "%d" % self.verbLevel
         clist = self.command + ["-v", vname, "-f", fname]
 
         try:
-            retcode = subprocess.call(clist)
+            if not checked:
+                retcode = subprocess.call(clist)
+                return retcode == 0
+            proc = subprocess.Popen(clist,
+                                    stdout=subprocess.PIPE,
+                                    stderr=subprocess.STDOUT,
+                                    universal_newlines=True)
+            stdout = proc.communicate()[0]
         except Exception as e:
             self.printInColor("Call of '%s' failed: %s" % (" ".join(clist), e), self.RED)
             return False
-        return retcode == 0
+        for f in glob.glob("%s/*.%d.*" % (self.traceDirectory, proc.pid)):
+            os.remove(f)
+        print(stdout, end='')
+        output = stdout.splitlines()
+        with open(oname) as f:
+            expected = f.read().splitlines()
+        if self.matchOutput(output, expected):
+            return True
+        self.printInColor("Output differs from %s:" % oname, self.RED)
+        for line in difflib.unified_diff(expected, output, "expected", "output", lineterm=''):
+            print(line)
+        return False
 
     def run(self, tid=0):
         scoreDict = {k: 0 for k in self.traceDict.keys()}
@@ -118,7 +173,7 @@ class Tracer:
             if self.verbLevel > 0:
                 print("+++ TESTING trace %s:" % tname)
             ok = self.runTrace(t)
-            maxval = self.maxScores[t]
+            maxval = 1 if self.selfTest else self.maxScores[t]
             tval = maxval if ok else 0
             if tval < maxval:
                 self.printInColor("---\t%s\t%d/%d" % (tname, tval, maxval), self.RED)
@@ -131,7 +186,7 @@ class Tracer:
             self.printInColor("---\tTOTAL\t\t%d/%d" % (score, maxscore), self.RED)
         else:
             self.printInColor("---\tTOTAL\t\t%d/%d" % (score, maxscore), self.GREEN)
-        if self.autograde:
+        if self.autograde and not self.selfTest:
             # Generate JSON string
             jstring = '{"scores": {'
             first = True
@@ -146,12 +201,13 @@ class Tracer:
             sys.exit(1)
 
 def usage(name):
-    print("Usage: %s [-h] [-p PROG] [-t TID] [-v LEVEL] [--valgrind] [-c]" % name)
+    print("Usage: %s [-h] [-p PROG] [-t TID] [-v LEVEL] [--valgrind] [-c] [-s]" % name)
     print("  -h        Print this message")
     print("  -p PROG   Program to test")
     print("  -t TID    Trace ID to test")
     print("  -v LEVEL  Set verbosity level (0-3)")
     print("  -c Enable colored text")
+    print("  -s        Run tests of qtest itself instead, not graded")
     sys.exit(0)
 
 
@@ -163,8 +219,9 @@ def run(name, args):
     autograde = False
     useValgrind = False
     colored = False
+    selfTest = False
 
-    optlist, args = getopt.getopt(args, 'hp:t:v:A:c', ['valgrind'])
+    optlist, args = getopt.getopt(args, 'hp:t:v:A:cs', ['valgrind'])
     for (opt, val) in optlist:
         if opt == '-h':
             usage(name)
@@ -181,6 +238,8 @@ def run(name, args):
             useValgrind = True
         elif opt == '-c':
             colored = True
+        elif opt == '-s':
+            selfTest = True
         else:
             print("Unrecognized option '%s'" % opt)
             usage(name)
@@ -190,7 +249,8 @@ def run(name, args):
                verbLevel=vlevel,
                autograde=autograde,
                useValgrind=useValgrind,
-               colored=colored)
+               colored=colored,
+               selfTest=selfTest)
     t.run(tid)
 
 
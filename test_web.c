@@ -1,70 +1,673 @@
+#define _GNU_SOURCE /* memmem */
 #include <arpa/inet.h>
+#include <getopt.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "ring.h"
+
 #define TARGET_HOST "127.0.0.1"
 #define TARGET_PORT 9999
 
 /* length of unique message (TODO below) should shorter than this */
 #define MAX_MSG_LEN 1024
+#define MAX_CONNS 1024
+#define MAX_DEPTH 64       /* requests in flight per connection, closed loop */
+#define MAX_INFLIGHT 1024  /* requests in flight per connection, open loop */
+#define MAX_MIX 16         /* commands in the mix */
+#define MAX_HELD 8         /* elements inserted by a client, if it removes */
 static const char *msg_dum = "GET /new HTTP/1.1\n\n";
 
-int main(void)
+static int port = TARGET_PORT;
+static char *unix_path = NULL; /* line protocol of Unix-domain socket */
+
+/* Responses received on a connection, not all consumed yet, and start times
+ * of the requests waiting for them, oldest first
+ */
+typedef struct {
+    int fd;
+    char buf[1 << 16];
+    size_t len;
+    char out[MAX_MSG_LEN * 16]; /* requests not sent yet */
+    size_t out_len;
+    int64_t start[MAX_INFLIGHT];
+    int head, inflight;
+    int size; /* elements inserted and not removed by requests sent */
+} client_t;
+
+/* Command of the mix, chosen with probability weight / total weight */
+typedef struct {
+    char path[MAX_MSG_LEN / 2];
+    char line[MAX_MSG_LEN / 2]; /* as a command, for the line protocol */
+    double weight;
+    int delta; /* change to queue size */
+} mix_t;
+
+static mix_t mix[MAX_MIX];
+static int mix_cnt = 0;
+static double mix_total = 0;
+static bool mix_removes = false; /* some commands remove elements */
+
+static int64_t now_ns()
 {
-    int sock_fd;
-    char dummy[MAX_MSG_LEN];
-    // struct timeval start, end;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-    sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+static int connect_server()
+{
+    int sock_fd = socket(unix_path ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
     if (sock_fd == -1) {
         perror("socket");
         exit(-1);
     }
 
+    if (unix_path) {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        strncpy(addr.sun_path, unix_path, sizeof(addr.sun_path) - 1);
+        if (connect(sock_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+            perror("connect");
+            exit(-1);
+        }
+        return sock_fd;
+    }
+
     struct sockaddr_in info = {
         .sin_family = PF_INET,
         .sin_addr.s_addr = inet_addr(TARGET_HOST),
-        .sin_port = htons(TARGET_PORT),
+        .sin_port = htons(port),
     };
 
     if (connect(sock_fd, (struct sockaddr *) &info, sizeof(info)) == -1) {
         perror("connect");
         exit(-1);
     }
-    send(sock_fd, msg_dum, strlen(msg_dum), 0);
-    recv(sock_fd, dummy, MAX_MSG_LEN, 0);
+    return sock_fd;
+}
 
-    shutdown(sock_fd, SHUT_RDWR);
-    close(sock_fd);
-
-    printf("%s\n", dummy);
-
-    int count = 0, last_pos = 0;
-    for (int i = 0; i < strlen(dummy); i++) {
-        if (dummy[i] == '\n') {
-            count++;
+static void send_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, 0);
+        if (n <= 0) {
+            perror("send");
+            exit(-1);
         }
-        if (count == 4) {
-            last_pos = i + 1;
-            break;
+        buf += n;
+        len -= n;
+    }
+}
+
+/* Length of the complete response of the line protocol at the start of buf,
+ * or 0 if it is not all there yet: records of output, each with its length
+ * on a line first, then the status of the command
+ */
+static size_t lines_size(const char *buf, size_t len, bool *ok)
+{
+    size_t pos = 0;
+    for (;;) {
+        char *eol = memchr(buf + pos, '\n', len - pos);
+        if (!eol)
+            return 0;
+        if (buf[pos] < '0' || buf[pos] > '9') {
+            *ok = !strncmp(buf + pos, "ok\n", 3);
+            return eol - buf + 1;
         }
+        pos = eol - buf + 1 + strtoul(buf + pos, NULL, 10);
+        if (pos > len)
+            return 0;
+    }
+}
+
+/* Length of the complete response at the start of buf, or 0 if it is not
+ * all there yet.  Its body starts after the first body_start bytes, and ok
+ * tells whether the request succeeded.
+ */
+static size_t response_size(const char *buf,
+                            size_t len,
+                            size_t *body_start,
+                            bool *ok)
+{
+    if (unix_path) {
+        *body_start = 0;
+        return lines_size(buf, len, ok);
+    }
+    *ok = !strncmp(buf, "HTTP/1.1 200", 12);
+
+    char *end = memmem(buf, len, "\r\n\r\n", 4);
+    if (!end)
+        return 0;
+    end += 4;
+    *body_start = end - buf;
+
+    size_t length = 0;
+    bool chunked = false;
+    for (const char *p = buf; p; p = memchr(p, '\n', end - p)) {
+        if (*p == '\n')
+            p++;
+        if (!strncasecmp(p, "Content-Length:", 15))
+            length = strtoul(p + 15, NULL, 10);
+        else if (!strncasecmp(p, "Transfer-Encoding: chunked", 26))
+            chunked = true;
+    }
+    if (!chunked)
+        return len >= *body_start + length ? *body_start + length : 0;
+
+    size_t pos = *body_start;
+    for (;;) {
+        char *eol = memmem(buf + pos, len - pos, "\r\n", 2);
+        if (!eol)
+            return 0;
+        size_t size = strtoul(buf + pos, NULL, 16);
+        pos = eol - buf + 2 + size + 2;
+        if (pos > len)
+            return 0;
+        if (!size)
+            return pos;
     }
+}
+
+/* Read more of the responses on connection */
+static void recv_more(client_t *c)
+{
+    if (c->len == sizeof(c->buf) - 1) {
+        fprintf(stderr, "Response too long\n");
+        exit(-1);
+    }
+    ssize_t n = recv(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len, 0);
+    if (n <= 0) {
+        fprintf(stderr, "Connection closed by server\n");
+        exit(-1);
+    }
+    c->len += n;
+    c->buf[c->len] = '\0';
+}
+
+/* Remove response of size bytes from connection */
+static void consume(client_t *c, size_t size)
+{
+    c->len -= size;
+    memmove(c->buf, c->buf + size, c->len + 1);
+}
+
+/* Receive next response, copying its body into body if not NULL */
+static void recv_response(client_t *c, char *body, size_t size)
+{
+    size_t total, start;
+    bool ok;
+    while (!(total = response_size(c->buf, c->len, &start, &ok)))
+        recv_more(c);
+    if (body) {
+        size_t n = total - start < size - 1 ? total - start : size - 1;
+        memcpy(body, c->buf + start, n);
+        body[n] = '\0';
+    }
+    consume(c, total);
+}
+
+/* Ask for a new queue */
+static void start_over(client_t *c)
+{
+    const char *msg = unix_path ? "new\n" : msg_dum;
+    send_all(c->fd, msg, strlen(msg));
+}
+
+static int check_new()
+{
+    client_t *c = calloc(1, sizeof(client_t));
+    char dummy[MAX_MSG_LEN];
+
+    c->fd = connect_server();
+    start_over(c);
+    recv_response(c, dummy, sizeof(dummy));
+
+    shutdown(c->fd, SHUT_RDWR);
+    close(c->fd);
+    free(c);
+
+    printf("%s\n", dummy);
+
+    /* Output of the command follows the HTML header line, or its length */
+    char *last_pos = strchr(dummy, '\n');
+    last_pos = last_pos ? last_pos + 1 : dummy;
 
     char const *answer = "l = []\n";
-    printf("%d %d\n", (int) strlen(answer), (int) strlen(dummy + last_pos));
+    printf("%d %d\n", (int) strlen(answer), (int) strlen(last_pos));
 
-    if (strncmp(answer, dummy + last_pos, strlen(answer)) == 0) {
+    if (strncmp(answer, last_pos, strlen(answer)) == 0) {
         printf("Match\n");
     } else {
         printf("No match\n");
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+/* Parse mix of commands such as "ih/1:3,rh:2,sort:0.1", commands being
+ * paths of URIs, with weight 1 if not given
+ */
+static bool parse_mix(char *spec)
+{
+    double keep = 0; /* weight of commands not removing elements */
+    mix_cnt = 0;
+    mix_total = 0;
+    for (char *item = strtok(spec, ","); item; item = strtok(NULL, ",")) {
+        if (mix_cnt == MAX_MIX)
+            return false;
+        mix_t *m = &mix[mix_cnt];
+        char *colon = strchr(item, ':');
+        m->weight = colon ? atof(colon + 1) : 1;
+        if (colon)
+            *colon = '\0';
+        if (!*item || m->weight < 0 || strlen(item) >= sizeof(m->path))
+            return false;
+        strncpy(m->path, item, sizeof(m->path));
+        strncpy(m->line, item, sizeof(m->line));
+        for (char *slash; (slash = strchr(m->line, '/'));)
+            *slash = ' ';
+        m->delta = 0;
+        if (!strncmp(item, "ih", 2) || !strncmp(item, "it", 2))
+            m->delta = 1;
+        else if (!strncmp(item, "rh", 2) || !strncmp(item, "rt", 2))
+            m->delta = -1;
+        if (m->delta >= 0)
+            keep += m->weight;
+        else if (m->weight > 0)
+            mix_removes = true;
+        mix_total += m->weight;
+        mix_cnt++;
+    }
+    return keep > 0;
+}
+
+/* Draw command from the mix, for client.
+ * Elements are only removed by a client that inserted them, so that its
+ * requests, run in order, never find the queue empty.  Unless the mix only
+ * grows the queue, a client keeps at most MAX_HELD elements in it, since
+ * every command checks all of the queue.
+ */
+static mix_t *draw_command(client_t *c)
+{
+    int i;
+    do {
+        double r = mix_total * rand() / ((double) RAND_MAX + 1);
+        i = 0;
+        while (i < mix_cnt - 1 && r >= mix[i].weight)
+            r -= mix[i++].weight;
+    } while ((mix[i].delta < 0 && !c->size) ||
+             (mix[i].delta > 0 && mix_removes && c->size >= MAX_HELD));
+    c->size += mix[i].delta;
+    return &mix[i];
+}
+
+/* Queue request with a command drawn from the mix, started at start */
+static void add_request(client_t *c, bool keep_alive, int64_t start)
+{
+    mix_t *m = draw_command(c);
+    size_t room = sizeof(c->out) - c->out_len;
+    if (unix_path)
+        c->out_len += snprintf(c->out + c->out_len, room, "%s\n", m->line);
+    else
+        c->out_len += snprintf(c->out + c->out_len, room,
+                               "GET /%s HTTP/1.1\r\n%s\r\n", m->path,
+                               keep_alive ? "" : "Connection: close\r\n");
+    c->start[(c->head + c->inflight++) % MAX_INFLIGHT] = start;
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void report_latency(int64_t *lat, int n)
+{
+    static const double fractions[] = {0.5, 0.9, 0.99, 0.999};
+    qsort(lat, n, sizeof(int64_t), compare_ns);
+    printf("Latency (us):");
+    for (size_t i = 0; i < sizeof(fractions) / sizeof(fractions[0]); i++) {
+        int rank = (int) (fractions[i] * n);
+        printf(" p%g %.1f", 100 * fractions[i],
+               1e-3 * lat[rank < n ? rank : n - 1]);
+    }
+    printf(" max %.1f\n", 1e-3 * lat[n - 1]);
+}
+
+/* Issue count commands over conns connections.
+ * In a closed loop, each connection keeps depth requests in flight, sending
+ * another one as soon as a response comes.  In an open loop, requests are
+ * due at rate per second whatever the responses, and are spread over the
+ * connections.  Latency then counts from when a request was due, so that
+ * a server falling behind shows as such, even if requests could not be sent
+ * in time.  Without keep-alive, each request is sent on a new connection.
+ */
+static int benchmark(int count,
+                     int conns,
+                     int depth,
+                     double rate,
+                     bool keep_alive)
+{
+    static client_t clients[MAX_CONNS];
+    struct pollfd fds[MAX_CONNS];
+    int64_t *lat = malloc(count * sizeof(int64_t));
+    int limit = rate > 0 ? MAX_INFLIGHT : depth;
+    if (!keep_alive)
+        limit = 1;
+    if (!lat) {
+        perror("malloc");
+        return -1;
+    }
+
+    /* Start with an empty queue */
+    clients[0].fd = connect_server();
+    start_over(&clients[0]);
+    recv_response(&clients[0], NULL, 0);
+    close(clients[0].fd);
+    for (int i = 0; i < conns; i++)
+        clients[i].fd = keep_alive ? connect_server() : -1;
+
+    int sent = 0, done = 0, errors = 0, next = 0;
+    int64_t start = now_ns();
+    while (done < count) {
+        int64_t now = now_ns();
+
+        /* Requests due, in turn on the connections that can take them */
+        int due = count;
+        if (rate > 0) {
+            due = (int) ((now - start) * 1e-9 * rate) + 1;
+            if (due > count)
+                due = count;
+        }
+        for (int tries = 0; sent < due && tries < conns; tries++) {
+            client_t *c = &clients[next];
+            next = (next + 1) % conns;
+            while (sent < due && c->inflight < limit &&
+                   c->out_len + MAX_MSG_LEN < sizeof(c->out)) {
+                int64_t when = rate > 0 ? start + (int64_t) (sent * 1e9 / rate)
+                                        : now;
+                if (c->fd < 0)
+                    c->fd = connect_server();
+                add_request(c, keep_alive, when);
+                sent++;
+                tries = 0;
+                if (rate > 0)
+                    break;
+            }
+        }
+        for (int i = 0; i < conns; i++) {
+            client_t *c = &clients[i];
+            if (c->out_len) {
+                send_all(c->fd, c->out, c->out_len);
+                c->out_len = 0;
+            }
+            fds[i].fd = c->inflight ? c->fd : -1;
+            fds[i].events = POLLIN;
+        }
+
+        /* Until the next request is due, if any */
+        int timeout = -1;
+        if (rate > 0 && sent < count) {
+            int64_t when = start + (int64_t) (sent * 1e9 / rate);
+            timeout = when > now ? (int) ((when - now) / 1000000) : 0;
+        }
+        if (poll(fds, conns, timeout) < 0) {
+            perror("poll");
+            return -1;
+        }
+
+        now = now_ns();
+        for (int i = 0; i < conns; i++) {
+            client_t *c = &clients[i];
+            if (!(fds[i].revents & (POLLIN | POLLERR | POLLHUP)))
+                continue;
+            recv_more(c);
+            size_t total, body;
+            bool ok;
+            while (c->inflight &&
+                   (total = response_size(c->buf, c->len, &body, &ok))) {
+                if (!ok)
+                    errors++;
+                consume(c, total);
+                lat[done++] = now - c->start[c->head];
+                c->head = (c->head + 1) % MAX_INFLIGHT;
+                c->inflight--;
+            }
+            if (!keep_alive && !c->inflight) {
+                close(c->fd);
+                c->fd = -1;
+                c->len = 0;
+            }
+        }
+    }
+    int64_t end = now_ns();
+
+    for (int i = 0; i < conns; i++) {
+        if (clients[i].fd >= 0)
+            close(clients[i].fd);
+    }
+
+    double elapsed = 1e-9 * (end - start);
+    if (rate > 0)
+        printf("%d commands at %.0f/s over %d connections: ", count, rate,
+               conns);
+    else
+        printf("%d commands over %d connections, %d in flight each: ", count,
+               conns, keep_alive ? depth : 1);
+    printf("%.3f s, %.0f commands/s\n", elapsed, count / elapsed);
+    report_latency(lat, count);
+    if (errors)
+        printf("%d errors\n", errors);
+    free(lat);
+    return 0;
+}
+
+/* Get ring from server on connection, with its eventfds */
+static ring_t *open_ring(client_t *c, int *submit_fd, int *results_fd)
+{
+    int fds[3];
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } control;
+    char answer[8];
+    struct iovec iov = {answer, sizeof(answer)};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    send_all(c->fd, "ring\n", 5);
+    ssize_t n = recvmsg(c->fd, &msg, 0);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (n < 3 || strncmp(answer, "ok\n", 3) || !cmsg ||
+        cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        fprintf(stderr, "No ring from server\n");
+        exit(-1);
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    ring_t *ring = mmap(NULL, sizeof(ring_t), PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    if (ring == MAP_FAILED) {
+        perror("mmap");
+        exit(-1);
+    }
+    *submit_fd = fds[1];
+    *results_fd = fds[2];
+    return ring;
+}
+
+/* Issue count commands through a ring in shared memory, keeping depth of
+ * them in flight, as described in ring.h
+ */
+static int benchmark_ring(int count, int depth)
+{
+    client_t *c = calloc(1, sizeof(client_t));
+    int64_t *lat = malloc(count * sizeof(int64_t));
+    if (!c || !lat) {
+        perror("malloc");
+        return -1;
+    }
+    c->fd = connect_server();
+    start_over(c);
+    recv_response(c, NULL, 0);
+    int submit_fd, results_fd;
+    ring_t *ring = open_ring(c, &submit_fd, &results_fd);
+
+    uint64_t sent = 0, done = 0;
+    int errors = 0;
+    int64_t start = now_ns();
+    while (done < (uint64_t) count) {
+        /* The server may have taken all before these */
+        uint64_t first = sent;
+        while (sent < (uint64_t) count && sent - done < (uint64_t) depth) {
+            ring_cmd_t *cmd = &ring->cmd[sent % RING_SLOTS];
+            cmd->len = snprintf(cmd->line, sizeof(cmd->line), "%s",
+                                draw_command(c)->line);
+            c->start[sent++ % MAX_INFLIGHT] = now_ns();
+        }
+        if (sent != first) {
+            atomic_store_explicit(&ring->cmds.tail, sent,
+                                  memory_order_release);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (atomic_load_explicit(&ring->cmds.head,
+                                     memory_order_relaxed) == first)
+                eventfd_write(submit_fd, 1);
+        }
+
+        /* Cleared before looking at the results, so as not to miss any */
+        eventfd_t signals;
+        eventfd_read(results_fd, &signals);
+        uint64_t tail =
+            atomic_load_explicit(&ring->results.tail, memory_order_acquire);
+        if (tail == done) {
+            /* The socket only tells when the server is gone */
+            struct pollfd pfd[2] = {
+                {.fd = results_fd, .events = POLLIN},
+                {.fd = c->fd, .events = POLLIN},
+            };
+            poll(pfd, 2, -1);
+            if (pfd[1].revents) {
+                fprintf(stderr, "Connection closed by server\n");
+                exit(-1);
+            }
+            continue;
+        }
+        int64_t now = now_ns();
+        for (; done < tail; done++) {
+            if (!ring->result[done % RING_SLOTS].ok)
+                errors++;
+            lat[done] = now - c->start[done % MAX_INFLIGHT];
+        }
+        atomic_store_explicit(&ring->results.head, done, memory_order_release);
+    }
+    int64_t end = now_ns();
+
+    double elapsed = 1e-9 * (end - start);
+    printf("%d commands through a ring, %d in flight: ", count, depth);
+    printf("%.3f s, %.0f commands/s\n", elapsed, count / elapsed);
+    report_latency(lat, count);
+    if (errors)
+        printf("%d errors\n", errors);
+    munmap(ring, sizeof(ring_t));
+    close(submit_fd);
+    close(results_fd);
+    close(c->fd);
+    free(c);
+    free(lat);
+    return 0;
+}
+
+static void usage(char *cmd)
+{
+    printf("Usage: %s [-n count] [-c conns] [-d depth] [-r rate] [-k] "
+           "[-m mix] [-p port | -u path [-R]]\n",
+           cmd);
+    printf("\tWithout options, check response to 'new'\n");
+    printf("\t-n count\tBenchmark with count commands\n");
+    printf("\t-c conns\tUse conns connections at once (default 4)\n");
+    printf("\t-d depth\tPipeline depth requests per connection (default 1)\n");
+    printf("\t-r rate\t\tSend rate requests per second, whatever the "
+           "responses\n");
+    printf("\t-k\t\tOpen a new connection for each request\n");
+    printf("\t-m mix\t\tCommands sent, with their weights "
+           "(default it/1,rh)\n");
+    printf("\t\t\tsuch as ih/1:3,it/2:3,rh:2,rt:2,sort:0.1\n");
+    printf("\t-p port\t\tPort of server (default %d)\n", TARGET_PORT);
+    printf("\t-u path\t\tUse Unix-domain socket of server at path\n");
+    printf("\t-R\t\tSend commands through a ring in shared memory\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    int count = 0, conns = 4, depth = 1;
+    double rate = 0;
+    bool keep_alive = true, use_ring = false;
+    char default_mix[] = "it/1,rh";
+    char *mix_spec = default_mix;
+    int c;
+    while ((c = getopt(argc, argv, "hn:c:d:r:km:p:u:R")) != -1) {
+        switch (c) {
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 'c':
+            conns = atoi(optarg);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'k':
+            keep_alive = false;
+            break;
+        case 'm':
+            mix_spec = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'u':
+            unix_path = optarg;
+            break;
+        case 'R':
+            use_ring = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (conns < 1 || conns > MAX_CONNS || depth < 1 || depth > MAX_DEPTH ||
+        rate < 0 || !parse_mix(mix_spec))
+        usage(argv[0]);
+    /* A ring is for one client, whose commands are not late */
+    if (use_ring && (!unix_path || rate > 0 || !keep_alive))
+        usage(argv[0]);
+
+    if (!count)
+        return check_new();
+    if (use_ring)
+        return benchmark_ring(count, depth);
+    return benchmark(count, conns, depth, rate, keep_alive);
+}
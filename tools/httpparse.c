@@ -0,0 +1,251 @@
+/* Benchmark and fuzzer for the HTTP request parser of the web server.
+ *
+ * By default, a mix of typical requests is parsed as it would arrive on a
+ * connection, split into reads of various sizes, and the throughput reported.
+ * With -f, randomly mutated requests are parsed both whole and split at
+ * random points, checking that the results agree and that URI decoding stays
+ * in bounds.  Build with SANITIZER=1 to catch any out-of-bounds access.
+ */
+
+#include <assert.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "http.h"
+
+static const char *samples[] = {
+    "GET /it/1 HTTP/1.1\r\n\r\n",
+    "GET /ih/RAND/10 HTTP/1.1\r\n"
+    "Host: localhost:9999\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n\r\n",
+    "GET /it/hello%20world HTTP/1.1\r\n"
+    "Host: localhost:9999\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cache-Control: max-age=0\r\n\r\n",
+    "POST /batch HTTP/1.1\r\n"
+    "Host: localhost:9999\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 0\r\n\r\n",
+    "GET /size HTTP/1.0\n\n",
+    "GET / HTTP/1.1\r\n\r\n",
+};
+
+#define N_SAMPLES (int) (sizeof(samples) / sizeof(samples[0]))
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/* Parse requests back to back from buf, read step bytes at a time */
+static size_t parse_all(const char *buf, size_t len, size_t step)
+{
+    http_parser_t p;
+    char line[512];
+    size_t start = 0, avail = 0, count = 0;
+
+    http_init(&p);
+    while (start < len) {
+        avail = avail + step < len ? avail + step : len;
+        http_status_t status;
+        while ((status = http_parse(&p, buf + start, avail - start)) ==
+               HTTP_DONE) {
+            http_decode_uri(buf + start + p.uri, p.uri_len, line,
+                            sizeof(line));
+            start += p.pos;
+            count++;
+            http_init(&p);
+        }
+        if (status == HTTP_ERROR) {
+            fprintf(stderr, "Unexpected error at %zu\n", start);
+            exit(1);
+        }
+    }
+    return count;
+}
+
+static void benchmark(size_t size)
+{
+    char *buf = malloc(size);
+    size_t len = 0;
+    for (int i = 0;; i = (i + 1) % N_SAMPLES) {
+        size_t n = strlen(samples[i]);
+        if (len + n > size)
+            break;
+        memcpy(buf + len, samples[i], n);
+        len += n;
+    }
+
+    static const size_t steps[] = {SIZE_MAX, 1460, 64, 1};
+    for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+        size_t count = 0, rounds = 0;
+        double start = now(), elapsed;
+        do {
+            count += parse_all(buf, len, steps[i]);
+            rounds++;
+        } while ((elapsed = now() - start) < 0.5);
+        char step[32] = "whole";
+        if (steps[i] != SIZE_MAX)
+            snprintf(step, sizeof(step), "%zu bytes", steps[i]);
+        printf("Reads of %-10s %8.1f MB/s %10.0f requests/s\n", step,
+               rounds * len / elapsed / 1e6, count / elapsed);
+    }
+    free(buf);
+}
+
+static void mutate(char *buf, size_t *len, size_t size)
+{
+    size_t pos = *len ? rand() % *len : 0;
+    switch (rand() % 5) {
+    case 0: /* replace a byte */
+        if (*len)
+            buf[pos] = rand() % 256;
+        break;
+    case 1: /* replace with something meaningful */
+        if (*len)
+            buf[pos] = " \r\n:%/0aF"[rand() % 9];
+        break;
+    case 2: /* insert a byte */
+        if (*len < size) {
+            memmove(buf + pos + 1, buf + pos, *len - pos);
+            buf[pos] = rand() % 256;
+            (*len)++;
+        }
+        break;
+    case 3: /* delete a byte */
+        if (*len) {
+            memmove(buf + pos, buf + pos + 1, *len - pos - 1);
+            (*len)--;
+        }
+        break;
+    case 4: /* truncate */
+        *len = pos;
+        break;
+    }
+}
+
+/* URIs decoded to known commands, before fuzzing */
+static void check_decode()
+{
+    static const struct {
+        const char *uri, *line;
+    } cases[] = {
+        {"/it/1", "it 1"},
+        {"/it/hello%20world?json", "it hello world"},
+        {"/", ""}, /* the empty command */
+        {"/?json", ""},
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        char line[64];
+        assert(http_decode_uri(cases[i].uri, strlen(cases[i].uri), line,
+                               sizeof(line)));
+        assert(!strcmp(line, cases[i].line));
+    }
+}
+
+static void fuzz(long iterations)
+{
+    check_decode();
+
+    char buf[1024];
+    for (long it = 0; it < iterations; it++) {
+        const char *sample = samples[rand() % N_SAMPLES];
+        size_t len = strlen(sample);
+        memcpy(buf, sample, len);
+        for (int i = rand() % 4; i >= 0; i--)
+            mutate(buf, &len, sizeof(buf));
+
+        /* Exactly len bytes, so that any read past them is caught */
+        char *req = malloc(len ? len : 1);
+        memcpy(req, buf, len);
+
+        http_parser_t whole, split;
+        http_init(&whole);
+        http_status_t status = http_parse(&whole, req, len);
+
+        http_init(&split);
+        http_status_t split_status = HTTP_AGAIN;
+        for (size_t avail = 0; split_status == HTTP_AGAIN && avail < len;) {
+            avail += 1 + rand() % 16;
+            if (avail > len)
+                avail = len;
+            split_status = http_parse(&split, req, avail);
+        }
+        if (!len)
+            split_status = http_parse(&split, req, 0);
+
+        assert(status == split_status);
+        if (status == HTTP_DONE) {
+            assert(whole.pos == split.pos && whole.pos <= len);
+            assert(whole.method == split.method);
+            assert(whole.uri == split.uri && whole.uri_len == split.uri_len);
+            assert(whole.uri + whole.uri_len <= len);
+            assert(whole.keep_alive == split.keep_alive);
+            assert(whole.content_length == split.content_length);
+
+            char line[64 + 1];
+            size_t size = 1 + rand() % 64;
+            line[size] = 0x5a;
+            if (http_decode_uri(req + whole.uri, whole.uri_len, line, size))
+                assert(strlen(line) < size && !strchr(line, '/'));
+            assert(line[size] == 0x5a);
+        }
+        free(req);
+    }
+    printf("%ld requests parsed\n", iterations);
+}
+
+static void usage(char *cmd)
+{
+    printf("Usage: %s [-f iterations] [-s seed] [-b bytes]\n", cmd);
+    printf("\t-f iterations\tFuzz instead of measuring throughput\n");
+    printf("\t-s seed\t\tSeed for fuzzing\n");
+    printf("\t-b bytes\tRequests parsed per round (default 1 MB)\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    long iterations = 0;
+    size_t size = 1 << 20;
+    unsigned seed = time(NULL);
+    int c;
+    while ((c = getopt(argc, argv, "hf:s:b:")) != -1) {
+        switch (c) {
+        case 'f':
+            iterations = atol(optarg);
+            break;
+        case 's':
+            seed = atoi(optarg);
+            break;
+        case 'b':
+            size = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (iterations) {
+        printf("Seed %u\n", seed);
+        srand(seed);
+        fuzz(iterations);
+    } else {
+        benchmark(size);
+    }
+    return 0;
+}
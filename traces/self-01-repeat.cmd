@@ -0,0 +1,22 @@
+# Test of repeat blocks: 'repeat n cmd' and nested 'repeat n {' ... '}'
+new
+repeat 3 it a
+repeat 2 {
+ih b
+repeat 2 {
+it c
+}
+}
+repeat 0 {
+ih never
+}
+show
+size 1
+repeat 2 rh b
+rh a
+free
+# A block without its '}' is reported, and the lines after it run once
+new
+repeat 3 {
+it d
+show
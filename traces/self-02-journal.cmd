@@ -0,0 +1,18 @@
+# Test of binary journals: 'record', 'convert', and replay with 'source'
+record traces/self-02-journal.$$.jnl
+new
+ih 42 3
+it gerbil
+repeat 2 {
+it 7
+}
+reverse
+record
+free
+# Replay of the recorded session
+source traces/self-02-journal.$$.jnl
+show
+free
+# Replay of a trace converted into a journal
+convert traces/trace-eg.cmd traces/self-02-journal.$$.jnl
+source traces/self-02-journal.$$.jnl
@@ -0,0 +1,20 @@
+# Test of 'select': switching to queues by ID, and running a command on one
+new
+ih a
+new
+ih b
+new
+ih c
+select 0
+it a2
+show
+select 2 rh c
+select 1 it b2
+show
+select 2
+show
+free
+select 2
+select 1
+rh b
+rh b2
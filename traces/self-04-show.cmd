@@ -0,0 +1,15 @@
+# Test of showing big queues: 'option window' and 'option check'
+new
+it 1 10
+it 2 40
+it 3 10
+show
+option window 3
+show
+option window 0
+option check 0
+ih 0
+show
+option check 1
+rh 0
+size
@@ -0,0 +1,12 @@
+# Test of 'option mblimit': allocations of the queue beyond the limit fail,
+# while the interpreter keeps working
+option mblimit 1
+new
+ih gerbil 40000
+rh gerbil
+free
+new
+ih dolphin
+it bear
+show
+free
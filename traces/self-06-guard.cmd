@@ -0,0 +1,19 @@
+# Test of 'option guard': queue operations on blocks ending at guard pages
+option guard 1
+new
+ih dolphin
+it meerkat
+ih bear
+reverse
+sort
+show
+rh bear
+rt meerkat
+it gerbil 1000
+dedup
+show
+free
+option guard 0
+new
+ih gerbil 3
+show
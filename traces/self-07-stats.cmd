@@ -0,0 +1,11 @@
+# Test of 'stats': count and latency of the commands run, except comments
+# and commands running others
+new
+ih a
+ih b 2
+repeat 3 it c
+time it d
+rh b
+stats ih rh it
+stats
+stats nosuch
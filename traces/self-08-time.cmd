@@ -0,0 +1,8 @@
+# Test of 'option time': a lower limit applies to the next operation, even
+# with the watchdog armed for a higher one
+option time 100
+new
+ih gerbil 10000
+option time 1
+size 1000000
+free
@@ -2,80 +2,475 @@
  * MIT License.
  */
 
+#define _GNU_SOURCE /* memfd_create */
 #include <arpa/inet.h> /* inet_ntoa */
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#else
+#include <poll.h>
+#endif
+
+#include "http.h"
+#include "report.h"
+#include "ring.h"
+#include "web.h"
+
 #define LISTENQ 1024 /* second argument to listen() */
-#define MAXLINE 1024 /* max length of a line */
 #define BUFSIZE 1024
+#define MAXCMD 512 /* longest command line */
+#define INBUFSIZE 8192 /* requests received but not parsed yet */
+#define MAXEVENTS 64   /* events handled per wakeup */
+#define MAXPENDING 64  /* commands queued per connection */
+#define CHUNKSIZE 65536 /* output of a command sent at once, when larger */
+#define HANDBACK 16     /* responses kept before handing them to a thread */
+#define MAXMETRICS 8    /* writers of metrics */
 
 #ifndef DEFAULT_PORT
 #define DEFAULT_PORT 9999 /* use this port if none given as arg to main() */
 #endif
 
-#if defined(__APPLE__) || defined(__FreeBSD__)
-#define TCP_CORK TCP_NOPUSH
+int web_connfd;
+
+struct __web_loop;
+
+/* State of a client connection.
+ * Sockets are non-blocking: whatever is readable is appended to the input
+ * buffer, and output is kept until the socket accepts it, so that a slow or
+ * idle client never holds up the console or the other clients.
+ * Connections are persistent, as is the default for HTTP/1.1, and a client
+ * may send further requests before getting the responses to the previous
+ * ones.  Requests are parsed as soon as they are complete.  The body of a
+ * POST request is a batch of commands, one per line, and each line is taken
+ * as soon as it is complete, so that a batch can be much larger than the
+ * input buffer.
+ * Clients of a Unix-domain socket speak a simpler protocol instead, with a
+ * command on each line, and the output of each in records of its length in
+ * decimal, a newline and as many bytes, followed by "ok" or "error" on a line
+ * of its own.  A client may ask for a ring in shared memory instead, which is
+ * then served as a connection of its own.
+ */
+typedef struct __web_conn {
+    struct __web_loop *loop; /* serving it */
+    int fd;
+    char in[INBUFSIZE]; /* partial request received so far */
+    size_t in_len;
+    http_parser_t parser; /* of request at start of input */
+    char *out; /* responses not sent yet */
+    size_t out_len, out_sent, out_size;
+    int pending;       /* commands queued or running */
+    size_t batch_left; /* bytes of batch not received yet */
+    bool batch_start;  /* next command of batch is the first */
+    bool skip_line;    /* rest of a line too long, already refused */
+    bool keep_alive;   /* of request being dispatched */
+    int format;        /* of request being dispatched */
+    bool eof;  /* no more requests from client */
+    bool done; /* no more responses to client, close once all sent */
+    bool lines; /* line protocol, on a Unix-domain socket */
+    ring_t *ring; /* commands and results, when the client has a ring */
+    int submit_fd, results_fd; /* eventfds of the ring */
+    int unsignalled;           /* results of the ring not signalled yet */
+} web_conn_t;
+
+/* Dispatch queue of commands from all clients, in order of arrival.
+ * The interpreter takes them one at a time, and the output of each goes to
+ * the connection it came from.  A connection with MAXPENDING commands in the
+ * queue is not read further until some of them have run, so that no client
+ * can fill up the queue.  Entries are recycled through a free list.
+ * Commands of a batch share one response, in chunked transfer encoding, with
+ * a chunk for the output of each command, and a last entry to end it.
+ * With ?json in the URI, the output of a command comes as a JSON object,
+ * along with its status, time and the queue size, and with ?json&contents,
+ * the elements of the queue too.  Those of a batch come one per line.
+ * Metrics are written when their request comes up in the queue, so that they
+ * are consistent, and nothing is counted for them in between.
+ * Commands of a ring go through the queue as well, their results being
+ * written into the ring rather than sent.
+ */
+typedef enum {
+    WEB_GET,       /* command in URI */
+    WEB_BATCH,     /* command in body of POST */
+    WEB_BATCH_END, /* no command, end of batch */
+    WEB_ERROR,     /* no command, malformed request */
+    WEB_METRICS,   /* no command, metrics asked for */
+    WEB_RING,      /* no command, ring handed to the interpreter */
+} web_cmd_kind_t;
+
+#define IS_BATCH(kind) ((kind) == WEB_BATCH || (kind) == WEB_BATCH_END)
+
+enum {
+    WEB_TEXT = 0,
+    WEB_JSON = 1,     /* JSON object for each command */
+    WEB_CONTENTS = 2, /* with contents of the queue */
+    WEB_LINES = 4,    /* line protocol */
+};
+
+typedef struct __web_cmd {
+    web_conn_t *conn;
+    web_cmd_kind_t kind;
+    bool start; /* first of batch, sending the header */
+    bool keep_alive;
+    int format;
+    bool partial;  /* copy carrying output of a command still running */
+    bool too_long; /* line cut to fit, failing instead of running */
+    int status;    /* HTTP status of WEB_ERROR */
+    char line[MAXCMD];
+    char *out; /* response, when the connection is served by a thread */
+    size_t out_len, out_size;
+    web_conn_t *ring; /* connection of ring, with WEB_RING */
+    struct __web_cmd *next;
+} web_cmd_t;
+
+/* Event loop serving connections.
+ * Without threads, there is just one, run by the interpreter while it waits
+ * for commands.  With threads, each of them runs one, with a listening socket
+ * of its own on the same port thanks to SO_REUSEPORT, so that the kernel
+ * spreads connections among them.  They read and parse requests, and hand
+ * the commands over to the interpreter, which runs them in order of arrival
+ * and hands them back with their responses, for the thread to send.  Queue
+ * operations thus stay in the interpreter, while socket I/O and parsing scale
+ * across cores.
+ */
+typedef struct __web_loop {
+#if defined(__linux__)
+    int event_fd;
+#else
+    struct pollfd poll_fds[MAXEVENTS];
+    int poll_cnt;
 #endif
+    int listen_fd;
+    bool lines;         /* listening on a Unix-domain socket */
+    web_conn_t **conns; /* indexed by descriptor, eventfds of rings too */
+    int conns_size;
+    web_cmd_t *free_cmds;
+    web_cmd_t *queue_head, *queue_tail; /* commands not handed over yet */
 
-static int server_fd;
-int web_connfd;
+    /* With threads */
+    pthread_t thread;
+    int wake_fd; /* signalled when responses are handed back */
+    _Atomic(web_cmd_t *) done_cmds; /* handed back, latest first */
+    web_cmd_t *outbox_head, *outbox_tail; /* done, kept by interpreter */
+    int outbox_len;
+} web_loop_t;
+
+/* Run by the interpreter, its queue is that of the commands to run */
+static web_loop_t main_loop;
+static web_loop_t *workers = NULL;
+static int n_workers = 0;
+static _Atomic(web_cmd_t *) new_cmds; /* handed over, latest first */
+
+static web_cmd_t *running = NULL; /* command of web_connfd */
+
+/* Output of the command running for web_connfd.  Its length has to be
+ * known before the header can be sent, so it is collected here first.  Once
+ * it gets larger than CHUNKSIZE, the response is sent in chunks instead, as
+ * it is always for a batch.
+ */
+static char *resp = NULL;
+static size_t resp_len = 0, resp_size = 0;
+static bool resp_chunked;     /* response is chunked */
+static bool resp_header_sent; /* header of response was sent */
+static size_t resp_total;     /* output, with what a ring result leaves out */
+
+/* Writer of JSON response, into the output above */
+static json_t resp_json;
+static bool run_ok;       /* status of command, as told by the interpreter */
+static int64_t run_start; /* time it was taken */
+static web_state_t state_writer = NULL;
+
+static web_metrics_t metrics_writers[MAXMETRICS];
+static int metrics_cnt = 0;
+
+/* Readiness notification.
+ * epoll is used where available, in edge-triggered mode for sockets, which
+ * are then always read and written until they would block.  Standard input
+ * is level-triggered instead, since it is consumed elsewhere, possibly one
+ * character at a time.  Other systems fall back to poll.
+ */
+#define EV_READ 1
+#define EV_WRITE 2
+
+#if defined(__linux__)
+static bool event_init(web_loop_t *loop)
+{
+    loop->event_fd = epoll_create1(EPOLL_CLOEXEC);
+    return loop->event_fd >= 0;
+}
+
+static bool event_add(web_loop_t *loop, int fd, bool edge)
+{
+    struct epoll_event ev = {
+        .events = EPOLLIN | (edge ? EPOLLOUT | EPOLLET : 0),
+        .data.fd = fd,
+    };
+    return epoll_ctl(loop->event_fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+static void event_del(web_loop_t *loop, int fd)
+{
+    epoll_ctl(loop->event_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/* Wait for events, filling in descriptors and EV_ flags of the ready ones */
+static int event_wait(web_loop_t *loop, int *fds, int *flags, int timeout)
+{
+    struct epoll_event events[MAXEVENTS];
+    int n = epoll_wait(loop->event_fd, events, MAXEVENTS, timeout);
+    for (int i = 0; i < n; i++) {
+        fds[i] = events[i].data.fd;
+        flags[i] = 0;
+        if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            flags[i] |= EV_READ;
+        if (events[i].events & EPOLLOUT)
+            flags[i] |= EV_WRITE;
+    }
+    return n;
+}
+#else
+static bool event_init(web_loop_t *loop)
+{
+    loop->poll_cnt = 0;
+    return true;
+}
+
+static bool event_add(web_loop_t *loop, int fd, bool edge)
+{
+    if (loop->poll_cnt == MAXEVENTS)
+        return false;
+    loop->poll_fds[loop->poll_cnt].fd = fd;
+    loop->poll_fds[loop->poll_cnt++].events = POLLIN;
+    return true;
+}
+
+static void event_del(web_loop_t *loop, int fd)
+{
+    for (int i = 0; i < loop->poll_cnt; i++) {
+        if (loop->poll_fds[i].fd == fd) {
+            loop->poll_fds[i] = loop->poll_fds[--loop->poll_cnt];
+            break;
+        }
+    }
+}
+
+static int event_wait(web_loop_t *loop, int *fds, int *flags, int timeout)
+{
+    struct pollfd *poll_fds = loop->poll_fds;
+    for (int i = 0; i < loop->poll_cnt; i++) {
+        int fd = poll_fds[i].fd;
+        web_conn_t *conn = fd < loop->conns_size ? loop->conns[fd] : NULL;
+        bool pending = conn && conn->out_sent < conn->out_len;
+        poll_fds[i].events = POLLIN | (pending ? POLLOUT : 0);
+    }
+    int n = poll(poll_fds, loop->poll_cnt, timeout);
+    if (n <= 0)
+        return n;
 
-typedef struct {
-    int fd;            /* descriptor for this buf */
-    int count;         /* unread byte in this buf */
-    char *bufptr;      /* next unread byte in this buf */
-    char buf[BUFSIZE]; /* internal buffer */
-} rio_t;
+    n = 0;
+    for (int i = 0; i < loop->poll_cnt; i++) {
+        short revents = poll_fds[i].revents;
+        if (!revents)
+            continue;
+        fds[n] = poll_fds[i].fd;
+        flags[n] = 0;
+        if (revents & (POLLIN | POLLERR | POLLHUP))
+            flags[n] |= EV_READ;
+        if (revents & POLLOUT)
+            flags[n] |= EV_WRITE;
+        n++;
+    }
+    return n;
+}
+#endif
+
+static bool stdin_pollable = false;
+static bool stdin_closed = false;
+
+static bool set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+static web_conn_t *find_conn(web_loop_t *loop, int fd)
+{
+    return fd >= 0 && fd < loop->conns_size ? loop->conns[fd] : NULL;
+}
+
+/* Make room in table of connections of loop for descriptor fd */
+static bool conns_reserve(web_loop_t *loop, int fd)
+{
+    if (fd < loop->conns_size)
+        return true;
+    int size = loop->conns_size ? loop->conns_size : 64;
+    while (size <= fd)
+        size *= 2;
+    web_conn_t **new_conns = realloc(loop->conns, size * sizeof(web_conn_t *));
+    if (!new_conns)
+        return false;
+    memset(new_conns + loop->conns_size, 0,
+           (size - loop->conns_size) * sizeof(web_conn_t *));
+    loop->conns = new_conns;
+    loop->conns_size = size;
+    return true;
+}
+
+static void conn_open(web_loop_t *loop, int fd)
+{
+    if (!conns_reserve(loop, fd)) {
+        close(fd);
+        return;
+    }
+
+    /* Responses are sent whole, and must not wait for the next one on a
+     * persistent connection
+     */
+    int optval = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const void *) &optval,
+               sizeof(int));
+
+    web_conn_t *conn = calloc(1, sizeof(web_conn_t));
+    if (!conn || !set_nonblocking(fd) || !event_add(loop, fd, true)) {
+        free(conn);
+        close(fd);
+        return;
+    }
+    conn->loop = loop;
+    conn->fd = fd;
+    http_init(&conn->parser);
+    if (loop->lines) {
+        conn->lines = true;
+        conn->keep_alive = true;
+        conn->format = WEB_LINES;
+    }
+    loop->conns[fd] = conn;
+}
+
+/* Unmap ring of connection, and close its eventfds */
+static void ring_free(web_conn_t *conn)
+{
+    if (conn->ring)
+        munmap(conn->ring, sizeof(ring_t));
+    if (conn->submit_fd >= 0)
+        close(conn->submit_fd);
+    if (conn->results_fd >= 0)
+        close(conn->results_fd);
+}
 
-typedef struct {
-    char filename[512];
-    off_t offset; /* for support Range */
-    size_t end;
-} http_request_t;
+/* Close connection once nothing is left to do on it */
+static void conn_release(web_conn_t *conn)
+{
+    if (conn->pending || conn->out_sent < conn->out_len ||
+        !(conn->done || conn->eof))
+        return;
+    event_del(conn->loop, conn->fd);
+    close(conn->fd);
+    conn->loop->conns[conn->fd] = NULL;
+    if (conn->ring) {
+        event_del(conn->loop, conn->submit_fd);
+        conn->loop->conns[conn->submit_fd] = NULL;
+        ring_free(conn);
+    }
+    free(conn->out);
+    free(conn);
+}
+
+/* Send as much pending output as the socket takes */
+static void conn_flush(web_conn_t *conn)
+{
+    while (conn->out_sent < conn->out_len) {
+        ssize_t n = send(conn->fd, conn->out + conn->out_sent,
+                         conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                conn->out_len = conn->out_sent = 0;
+                conn->done = true;
+                conn_release(conn);
+            }
+            return;
+        }
+        conn->out_sent += n;
+    }
+    conn->out_len = conn->out_sent = 0;
+    conn_release(conn);
+}
+
+/* Append len bytes to buffer, growing it as needed */
+static bool buf_append(char **buf,
+                       size_t *buf_len,
+                       size_t *buf_size,
+                       const char *data,
+                       size_t len)
+{
+    if (*buf_len + len > *buf_size) {
+        size_t size = *buf_size ? *buf_size : BUFSIZE;
+        while (size < *buf_len + len)
+            size *= 2;
+        char *bigger = realloc(*buf, size);
+        if (!bigger)
+            return false;
+        *buf = bigger;
+        *buf_size = size;
+    }
+    memcpy(*buf + *buf_len, data, len);
+    *buf_len += len;
+    return true;
+}
 
-static void rio_readinitb(rio_t *rp, int fd)
+static void conn_write(web_conn_t *conn, const char *buf, size_t len)
 {
-    rp->fd = fd;
-    rp->count = 0;
-    rp->bufptr = rp->buf;
+    buf_append(&conn->out, &conn->out_len, &conn->out_size, buf, len);
 }
 
-/* This is a wrapper for the Unix read() function that transfers min(n, count)
- * bytes from an internal buffer to a user buffer, where n is the number of
- * bytes requested by the user and count is the number of unread bytes in the
- * internal buffer. On entry, rio_read() refills the internal buffer via a call
- * to read() if the internal buffer is empty.
+/* Send pieces of a response in one system call, keeping whatever the socket
+ * does not take for later.  Output is only copied when the socket is busy.
+ * sendmsg is writev with flags, so a closed socket gives an error, and no
+ * SIGPIPE.
  */
-/* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
-{
-    int cnt;
-    while (rp->count <= 0) { /* refill if buf is empty */
-        rp->count = read(rp->fd, rp->buf, sizeof(rp->buf));
-        if (rp->count < 0) {
-            if (errno != EINTR) /* interrupted by sig handler return */
-                return -1;
-        } else if (rp->count == 0) { /* EOF */
-            return 0;
-        } else
-            rp->bufptr = rp->buf; /* reset buffer ptr */
+static void conn_writev(web_conn_t *conn, struct iovec *iov, int cnt)
+{
+    ssize_t n = 0;
+    if (conn->out_sent == conn->out_len) {
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = cnt};
+        while ((n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL)) < 0 &&
+               errno == EINTR)
+            ;
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                conn->done = true;
+                return;
+            }
+            n = 0;
+        }
     }
 
-    /* Copy min(n, rp->count) bytes from internal buf to user buf */
-    cnt = n;
-    if (rp->count < n)
-        cnt = rp->count;
-    memcpy(usrbuf, rp->bufptr, cnt);
-    rp->bufptr += cnt;
-    rp->count -= cnt;
-    return cnt;
+    for (int i = 0; i < cnt; i++) {
+        size_t len = iov[i].iov_len;
+        if ((size_t) n >= len) {
+            n -= len;
+            continue;
+        }
+        conn_write(conn, (char *) iov[i].iov_base + n, len - n);
+        n = 0;
+    }
 }
 
 static ssize_t writen(int fd, void *usrbuf, size_t n)
@@ -97,49 +492,8 @@ static ssize_t writen(int fd, void *usrbuf, size_t n)
     return n;
 }
 
-/* robustly read a text line (buffered) */
-static ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
-{
-    char c, *bufp = usrbuf;
-
-    int n;
-    for (n = 1; n < maxlen; n++) {
-        int rc;
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n')
-                break;
-        } else if (rc == 0) {
-            if (n == 1)
-                return 0; /* EOF, no data read */
-            break;        /* EOF, some data was read */
-        } else
-            return -1; /* error */
-    }
-    *bufp = 0;
-    return n;
-}
-
-void send_response(int out_fd)
-{
-    char *buf =
-        "HTTP/1.1 200 OK\r\n%s%s%s%s%s%s"
-        "Content-Type: text/html\r\n\r\n"
-        "<html><head><style>"
-        "body{font-family: monospace; font-size: 13px;}"
-        "td {padding: 1.5px 6px;}"
-        "</style><link rel=\"shortcut icon\" href=\"data:image/x-icon;,\" "
-        "type=\"image/x-icon\">"
-        "</head><body><table>\n";
-    writen(out_fd, buf, strlen(buf));
-}
-
-void web_send(int out_fd, char *buf)
-{
-    writen(out_fd, buf, strlen(buf));
-}
-
-int web_open(int port)
+/* Open listening socket on port, one of many on it if reuse_port is set */
+static int open_listen(int port, bool reuse_port)
 {
     int listenfd, optval = 1;
     struct sockaddr_in serveraddr;
@@ -153,10 +507,9 @@ int web_open(int port)
                    sizeof(int)) < 0)
         return -1;
 
-    // 6 is TCP's protocol number
-    // enable this, much faster : 4000 req/s -> 17000 req/s
-    if (setsockopt(listenfd, IPPROTO_TCP, TCP_CORK, (const void *) &optval,
-                   sizeof(int)) < 0)
+    /* Connections are then balanced among the sockets bound to port */
+    if (reuse_port && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                                 (const void *) &optval, sizeof(int)) < 0)
         return -1;
 
     /* Listenfd will be an endpoint for all requests to port
@@ -172,112 +525,1200 @@ int web_open(int port)
     if (listen(listenfd, LISTENQ) < 0)
         return -1;
 
-    server_fd = listenfd;
+    if (!set_nonblocking(listenfd))
+        return -1;
+    return listenfd;
+}
+
+/* Path of the Unix-domain socket listened on, removed by web_close */
+static char *unix_path = NULL;
+
+/* Whether a server accepts connections on Unix-domain socket at addr, rather
+ * than the socket being left behind by one that is gone
+ */
+static bool unix_in_use(const struct sockaddr_un *addr)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return false;
+    bool used = !connect(fd, (const struct sockaddr *) addr, sizeof(*addr)) ||
+                (errno != ECONNREFUSED && errno != ENOENT);
+    close(fd);
+    return used;
+}
+
+/* Open listening Unix-domain socket at path, replacing one left there.
+ * Fail with EADDRINUSE if another server listens on it, or ENOTSOCK if
+ * something else is there.
+ */
+static int open_listen_unix(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    struct stat st;
+    if (!lstat(path, &st)) {
+        if (!S_ISSOCK(st.st_mode)) {
+            errno = ENOTSOCK;
+            return -1;
+        }
+        if (unix_in_use(&addr)) {
+            errno = EADDRINUSE;
+            return -1;
+        }
+        unlink(path);
+    }
 
+    int listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenfd < 0)
+        return -1;
+    if (bind(listenfd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(listenfd);
+        return -1;
+    }
+    unix_path = strdup(path);
+    if (!unix_path || listen(listenfd, LISTENQ) < 0 ||
+        !set_nonblocking(listenfd)) {
+        int err = errno;
+        close(listenfd);
+        if (unix_path)
+            web_close();
+        else
+            unlink(path);
+        errno = err;
+        return -1;
+    }
     return listenfd;
 }
 
-static void url_decode(char *src, char *dest, int max)
+/* Queue command of len bytes from line, for connection */
+static web_cmd_t *dispatch(web_conn_t *conn,
+                           web_cmd_kind_t kind,
+                           const char *line,
+                           size_t len)
+{
+    web_loop_t *loop = conn->loop;
+    web_cmd_t *cmd = loop->free_cmds;
+    if (cmd) {
+        loop->free_cmds = cmd->next;
+    } else {
+        if (!(cmd = malloc(sizeof(web_cmd_t))))
+            return NULL;
+        cmd->out = NULL;
+        cmd->out_size = 0;
+    }
+    cmd->out_len = 0;
+    cmd->partial = false;
+
+    cmd->too_long = len >= sizeof(cmd->line);
+    if (cmd->too_long)
+        len = sizeof(cmd->line) - 1;
+    memcpy(cmd->line, line, len);
+    cmd->line[len] = '\0';
+
+    cmd->conn = conn;
+    cmd->kind = kind;
+    cmd->ring = NULL;
+    cmd->status = 400;
+    cmd->start = false;
+    cmd->keep_alive = conn->keep_alive;
+    cmd->format = conn->format;
+    if (IS_BATCH(kind)) {
+        cmd->start = conn->batch_start;
+        conn->batch_start = false;
+    }
+    cmd->next = NULL;
+    if (loop->queue_tail)
+        loop->queue_tail->next = cmd;
+    else
+        loop->queue_head = cmd;
+    loop->queue_tail = cmd;
+    conn->pending++;
+    return cmd;
+}
+
+/* Queue error response with status for connection, of which nothing after
+ * can be trusted
+ */
+static void dispatch_error(web_conn_t *conn, int status)
 {
-    char *p = src;
-    char code[3] = {0};
-    while (*p && --max) {
-        if (*p == '%') {
-            memcpy(code, ++p, 2);
-            *dest++ = (char) strtoul(code, NULL, 16);
-            p += 2;
+    conn->keep_alive = false;
+    web_cmd_t *cmd = dispatch(conn, WEB_ERROR, "", 0);
+    if (cmd)
+        cmd->status = status;
+    conn->eof = true;
+}
+
+/* Queue command of next line of batch from buffer, returning bytes used, or
+ * 0 if the line is not complete yet.  A line too long for a command is taken
+ * as soon as that is clear, failing, and the rest of it skipped.
+ */
+static size_t dispatch_batch(web_conn_t *conn, char *buf, size_t len)
+{
+    if (len > conn->batch_left)
+        len = conn->batch_left;
+    char *eol = memchr(buf, '\n', len);
+    bool last = len == conn->batch_left; /* need not be terminated */
+    if (!eol && !last && len < MAXCMD)
+        return 0;
+
+    size_t used = eol ? eol - buf + 1 : len;
+    size_t line_len = eol ? eol - buf : len;
+    if ((eol || last) && line_len && buf[line_len - 1] == '\r')
+        line_len--;
+    if (line_len && !conn->skip_line)
+        dispatch(conn, WEB_BATCH, buf, line_len);
+    conn->skip_line = !eol && !last;
+    conn->batch_left -= used;
+    if (!conn->batch_left)
+        dispatch(conn, WEB_BATCH_END, "", 0);
+    return used;
+}
+
+static void wake_clear(int fd);
+static void ring_open(web_conn_t *conn);
+static void ring_take(web_conn_t *conn);
+
+/* Queue commands of the complete lines received on connection, and of those
+ * too long for a command, which fail, as soon as that is clear
+ */
+static void conn_parse_lines(web_conn_t *conn)
+{
+    char *start = conn->in;
+    while (conn->pending < MAXPENDING && !conn->done) {
+        size_t len = conn->in + conn->in_len - start;
+        char *eol = memchr(start, '\n', len);
+        if (!eol && len < MAXCMD)
+            break;
+        char *next = eol ? eol + 1 : start + len;
+        if (eol)
+            len = eol - start;
+        if (eol && len && start[len - 1] == '\r')
+            len--;
+        bool skip = conn->skip_line;
+        conn->skip_line = !eol;
+        if (skip) {
+            start = next;
+            continue;
+        }
+        if (len == 4 && !strncmp(start, "ring", 4)) {
+            /* Nothing after it is for this connection */
+            ring_open(conn);
+            start = conn->in + conn->in_len;
+            break;
+        }
+        if (len == 7 && !strncmp(start, "metrics", 7))
+            dispatch(conn, WEB_METRICS, "", 0);
+        else if (len)
+            dispatch(conn, WEB_GET, start, len);
+        start = next;
+    }
+    conn->in_len -= start - conn->in;
+    memmove(conn->in, start, conn->in_len + 1);
+}
+
+/* Queue commands of the complete requests received on connection.
+ * The parser goes on from where it stopped, with what was received since.
+ */
+static void conn_parse(web_conn_t *conn)
+{
+    if (conn->ring) {
+        /* Commands come through the ring, nothing else on the socket */
+        conn->in_len = 0;
+        ring_take(conn);
+        return;
+    }
+    if (conn->lines) {
+        conn_parse_lines(conn);
+        return;
+    }
+
+    http_parser_t *p = &conn->parser;
+    char *start = conn->in;
+    while (conn->pending < MAXPENDING && !conn->done) {
+        size_t len = conn->in + conn->in_len - start;
+        if (conn->batch_left) {
+            size_t used = dispatch_batch(conn, start, len);
+            if (!used)
+                break;
+            start += used;
+            continue;
+        }
+
+        http_status_t status = http_parse(p, start, len);
+        if (status == HTTP_AGAIN)
+            break;
+
+        /* Other methods and bodies of chunks are refused rather than taken
+         * for a GET, or the chunks for requests
+         */
+        char line[MAXCMD];
+        int error = status == HTTP_DONE ? 0 : 400;
+        if (!error && (p->method == HTTP_OTHER || p->chunked))
+            error = 501;
+        if (!error && p->method != HTTP_POST &&
+            !http_decode_uri(start + p->uri, p->uri_len, line, sizeof(line)))
+            error = p->uri_len >= sizeof(line) ? 414 : 400;
+        if (error) {
+            dispatch_error(conn, error);
+            start = conn->in + conn->in_len;
+            break;
+        }
+        conn->keep_alive = p->keep_alive;
+        conn->format = WEB_TEXT;
+        if (http_query_has(start + p->uri, p->uri_len, "json")) {
+            conn->format = WEB_JSON;
+            if (http_query_has(start + p->uri, p->uri_len, "contents"))
+                conn->format |= WEB_CONTENTS;
+        }
+        start += p->pos;
+
+        if (p->method == HTTP_POST) {
+            conn->batch_left = p->content_length;
+            conn->batch_start = true;
+            if (!p->content_length)
+                dispatch(conn, WEB_BATCH_END, "", 0);
+        } else if (!strcmp(line, "metrics")) {
+            dispatch(conn, WEB_METRICS, "", 0);
         } else {
-            *dest++ = *p++;
+            dispatch(conn, WEB_GET, line, strlen(line));
         }
+        http_init(p);
     }
-    *dest = '\0';
+    conn->in_len -= start - conn->in;
+    memmove(conn->in, start, conn->in_len + 1);
 }
 
-static void parse_request(int fd, http_request_t *req)
+/* Read what is available on connection, queueing requests once complete.
+ * Reading stops while the dispatch queue holds enough from this client.
+ */
+static void conn_read(web_conn_t *conn)
 {
-    rio_t rio;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE];
-    req->offset = 0;
-    req->end = 0; /* default */
+    while (!conn->eof && !conn->done && conn->pending < MAXPENDING) {
+        if (conn->in_len == sizeof(conn->in) - 1) {
+            /* Request too long, told so before closing, unless the response
+             * to a batch has begun
+             */
+            if (conn->batch_left)
+                conn->done = true;
+            else
+                dispatch_error(conn, 431);
+            conn->in_len = 0;
+            break;
+        }
+        ssize_t n = read(conn->fd, conn->in + conn->in_len,
+                         sizeof(conn->in) - 1 - conn->in_len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                conn->done = true;
+            break;
+        }
+        /* Closed by client, which may still wait for the responses */
+        if (n == 0) {
+            conn->eof = true;
+            break;
+        }
+        conn->in_len += n;
+        conn->in[conn->in_len] = '\0';
+        conn_parse(conn);
+    }
+    conn_release(conn);
+}
 
-    rio_readinitb(&rio, fd);
-    rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%1023s %1023s", method, uri); /* version is not cared */
-    /* read all */
-    while (buf[0] != '\n' && buf[1] != '\n') { /* \n || \r\n */
-        rio_readlineb(&rio, buf, MAXLINE);
-        if (buf[0] == 'R' && buf[1] == 'a' && buf[2] == 'n') {
-            sscanf(buf, "Range: bytes=%lu-%lu", (unsigned long *) &req->offset,
-                   (unsigned long *) &req->end);
-            /* Range: [start, end] */
-            if (req->end != 0)
-                req->end++;
+static void accept_all(web_loop_t *loop)
+{
+    for (;;) {
+        struct sockaddr_in clientaddr;
+        socklen_t clientlen = sizeof(clientaddr);
+        int fd = accept(loop->listen_fd, (struct sockaddr *) &clientaddr,
+                        &clientlen);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
         }
+        conn_open(loop, fd);
     }
-    char *filename = uri;
-    if (uri[0] == '/') {
-        filename = uri + 1;
-        int length = strlen(filename);
-        if (length == 0) {
-            filename = ".";
+}
+
+/* Handle readiness of listening socket or connection of loop */
+static void loop_event(web_loop_t *loop, int fd, int flags)
+{
+    if (fd == loop->listen_fd) {
+        accept_all(loop);
+        return;
+    }
+    web_conn_t *conn = find_conn(loop, fd);
+    if (conn && conn->ring && fd == conn->submit_fd) {
+        wake_clear(fd);
+        ring_take(conn);
+        return;
+    }
+    if (conn && (flags & EV_WRITE))
+        conn_flush(conn);
+    if (conn && loop->conns[fd] == conn && (flags & EV_READ))
+        conn_read(conn);
+}
+
+static const char html_head[] =
+    "<html><head><style>"
+    "body{font-family: monospace; font-size: 13px;}"
+    "td {padding: 1.5px 6px;}"
+    "</style><link rel=\"shortcut icon\" href=\"data:image/x-icon;,\" "
+    "type=\"image/x-icon\">"
+    "</head><body><table>\n";
+
+static void resp_write(const char *buf, size_t len);
+
+static void resp_sink(void *ctx, const char *buf, size_t len)
+{
+    resp_write(buf, len);
+}
+
+/* Start response to a command, which collects its output until it is done */
+static void start_response(web_cmd_t *cmd)
+{
+    resp_len = resp_total = 0;
+    resp_chunked = IS_BATCH(cmd->kind);
+    resp_header_sent = IS_BATCH(cmd->kind) && !cmd->start;
+    if (cmd->kind == WEB_BATCH_END)
+        return;
+    if (cmd->format & WEB_JSON) {
+        /* Output goes into a string, escaped as it comes */
+        json_init(&resp_json, resp_sink, NULL);
+        json_object_begin(&resp_json);
+        json_key(&resp_json, "cmd");
+        json_string(&resp_json, cmd->line);
+        json_key(&resp_json, "output");
+        json_string_begin(&resp_json);
+    } else if (cmd->kind == WEB_BATCH) {
+        /* Results of a batch tell which command they are from */
+        char *prompt = "cmd> ";
+        buf_append(&resp, &resp_len, &resp_size, prompt, strlen(prompt));
+        buf_append(&resp, &resp_len, &resp_size, cmd->line, strlen(cmd->line));
+        buf_append(&resp, &resp_len, &resp_size, "\n", 1);
+    }
+}
+
+/* Complete JSON object of command, once it has run */
+static void end_json(web_cmd_t *cmd)
+{
+    int64_t elapsed = time_ns() - run_start;
+    json_string_end(&resp_json);
+    json_key(&resp_json, "ok");
+    json_bool(&resp_json, run_ok);
+    json_key(&resp_json, "ns");
+    json_int(&resp_json, elapsed);
+    if (state_writer)
+        state_writer(&resp_json, cmd->format & WEB_CONTENTS);
+    json_object_end(&resp_json);
+    resp_write("\n", 1);
+}
+
+static int format_header(char *buf, web_cmd_t *cmd, size_t length)
+{
+    const char *type = cmd->kind == WEB_GET ? "text/html" : "text/plain";
+    if (cmd->format & WEB_JSON)
+        type = cmd->kind == WEB_GET ? "application/json"
+                                    : "application/x-ndjson";
+    if (cmd->kind == WEB_METRICS)
+        type = "text/plain; version=0.0.4";
+    const char *conn = cmd->keep_alive ? "" : "Connection: close\r\n";
+    if (resp_chunked) {
+        return snprintf(buf, BUFSIZE,
+                        "HTTP/1.1 200 OK\r\n"
+                        "Content-Type: %s\r\n"
+                        "Transfer-Encoding: chunked\r\n"
+                        "%s\r\n",
+                        type, conn);
+    }
+    return snprintf(buf, BUFSIZE,
+                    "HTTP/1.1 200 OK\r\n"
+                    "Content-Type: %s\r\n"
+                    "Content-Length: %zu\r\n"
+                    "%s\r\n",
+                    type, length, conn);
+}
+
+/* Queue pieces of response to command.  Without threads, they are sent
+ * right away, else collected for the thread serving the connection.
+ */
+static void cmd_output(web_cmd_t *cmd, struct iovec *iov, int cnt)
+{
+    if (!n_workers) {
+        conn_writev(cmd->conn, iov, cnt);
+        return;
+    }
+    for (int i = 0; i < cnt; i++)
+        buf_append(&cmd->out, &cmd->out_len, &cmd->out_size, iov[i].iov_base,
+                   iov[i].iov_len);
+}
+
+/* Send output collected so far, as a chunk when the response is chunked.
+ * The header goes first, with the HTML head for text output of a command in
+ * the URI.
+ * These are all sent together, without copying them.
+ */
+static void send_output(web_cmd_t *cmd, bool last)
+{
+    char header[BUFSIZE];
+    int len = 0;
+    size_t head_len = 0;
+    struct iovec iov[4];
+    int cnt = 0;
+
+    if (cmd->format & WEB_LINES) {
+        if (resp_len) {
+            len = snprintf(header, BUFSIZE, "%zu\n", resp_len);
+            iov[cnt++] = (struct iovec){header, len};
+            iov[cnt++] = (struct iovec){resp, resp_len};
+        }
+        if (last) {
+            char *status = run_ok ? "ok\n" : "error\n";
+            iov[cnt++] = (struct iovec){status, strlen(status)};
+        }
+        if (cnt)
+            cmd_output(cmd, iov, cnt);
+        resp_len = 0;
+        return;
+    }
+
+    if (!resp_header_sent) {
+        if (cmd->kind == WEB_GET && !(cmd->format & WEB_JSON))
+            head_len = sizeof(html_head) - 1;
+        len = format_header(header, cmd, head_len + resp_len);
+        resp_header_sent = true;
+    }
+    size_t size = head_len + resp_len;
+    if (resp_chunked && size)
+        len += snprintf(header + len, BUFSIZE - len, "%zx\r\n", size);
+    iov[cnt++] = (struct iovec){header, len};
+    if (head_len)
+        iov[cnt++] = (struct iovec){(void *) html_head, head_len};
+    if (resp_len)
+        iov[cnt++] = (struct iovec){resp, resp_len};
+    if (resp_chunked) {
+        /* End of chunk, and of the response, with an empty chunk */
+        static char trailer[] = "\r\n0\r\n\r\n";
+        char *end = size ? trailer : trailer + 2;
+        size_t end_len = strlen(end) - (last ? 0 : 5);
+        if (end_len)
+            iov[cnt++] = (struct iovec){end, end_len};
+    }
+    cmd_output(cmd, iov, cnt);
+    resp_len = 0;
+}
+
+static const char *status_text(int status)
+{
+    switch (status) {
+    case 414:
+        return "URI Too Long";
+    case 431:
+        return "Request Header Fields Too Large";
+    case 501:
+        return "Not Implemented";
+    default:
+        return "Bad Request";
+    }
+}
+
+/* Queue response to command on its connection */
+static void send_response(web_cmd_t *cmd)
+{
+    if (cmd->kind == WEB_ERROR) {
+        char answer[BUFSIZE] = "error\n";
+        if (!(cmd->format & WEB_LINES))
+            snprintf(answer, BUFSIZE,
+                     "HTTP/1.1 %d %s\r\n"
+                     "Content-Length: 0\r\n"
+                     "Connection: close\r\n\r\n",
+                     cmd->status, status_text(cmd->status));
+        struct iovec iov = {answer, strlen(answer)};
+        cmd_output(cmd, &iov, 1);
+        return;
+    }
+    if (cmd->kind == WEB_RING)
+        return;
+    if (cmd->kind == WEB_BATCH_END) {
+        start_response(cmd);
+        send_output(cmd, true);
+    } else {
+        send_output(cmd, !IS_BATCH(cmd->kind));
+    }
+}
+
+/* Recycle command whose response is queued, going on with its connection */
+static void end_command(web_cmd_t *cmd)
+{
+    web_conn_t *conn = cmd->conn;
+    if (cmd->kind == WEB_ERROR ||
+        (cmd->kind != WEB_BATCH && !cmd->keep_alive))
+        conn->done = true;
+    cmd->next = conn->loop->free_cmds;
+    conn->loop->free_cmds = cmd;
+
+    /* Resume reading requests held back by a full queue.  Other commands
+     * still pending keep the connection open meanwhile.
+     */
+    if (--conn->pending == MAXPENDING - 1 && !conn->done) {
+        conn_parse(conn);
+        conn_read(conn);
+    }
+    conn_flush(conn);
+}
+
+/* Lock-free handover of commands between threads.
+ * Producers push lists of commands onto a stack with compare-and-swap, and
+ * the consumer takes all of it at once by swapping in an empty one, so that
+ * there is no ABA problem.  The producer finding the stack empty wakes up the
+ * consumer, which clears the wakeup before taking the stack, so that nothing
+ * pushed can be missed.
+ */
+#if defined(__linux__)
+static int wake_open()
+{
+    return eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+static void wake_up(int fd)
+{
+    eventfd_write(fd, 1);
+}
+
+static void wake_clear(int fd)
+{
+    eventfd_t count;
+    eventfd_read(fd, &count);
+}
+#else
+/* Threads are only supported along with epoll */
+static int wake_open()
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+static void wake_up(int fd) {}
+
+static void wake_clear(int fd) {}
+#endif
+
+static web_cmd_t *reverse(web_cmd_t *list)
+{
+    web_cmd_t *prev = NULL;
+    while (list) {
+        web_cmd_t *next = list->next;
+        list->next = prev;
+        prev = list;
+        list = next;
+    }
+    return prev;
+}
+
+/* Push list of commands, in order, onto stack, waking up its consumer */
+static void handover(_Atomic(web_cmd_t *) *stack, int wake_fd, web_cmd_t *list)
+{
+    web_cmd_t *first = list;
+    web_cmd_t *top = reverse(list);
+    web_cmd_t *old = atomic_load_explicit(stack, memory_order_relaxed);
+    do {
+        first->next = old;
+    } while (!atomic_compare_exchange_weak_explicit(
+        stack, &old, top, memory_order_release, memory_order_relaxed));
+    if (!old)
+        wake_up(wake_fd);
+}
+
+/* Take all commands from stack, in order */
+static web_cmd_t *take_over(_Atomic(web_cmd_t *) *stack, int wake_fd)
+{
+    wake_clear(wake_fd);
+    return reverse(atomic_exchange_explicit(stack, NULL, memory_order_acquire));
+}
+
+/* Hand commands done back to the threads serving their connections */
+static void hand_back(web_loop_t *loop)
+{
+    if (!loop->outbox_head)
+        return;
+    handover(&loop->done_cmds, loop->wake_fd, loop->outbox_head);
+    loop->outbox_head = loop->outbox_tail = NULL;
+    loop->outbox_len = 0;
+}
+
+static void hand_back_all()
+{
+    for (int i = 0; i < n_workers; i++)
+        hand_back(&workers[i]);
+}
+
+/* Keep command done for the thread serving its connection */
+static void keep_done(web_cmd_t *cmd)
+{
+    web_loop_t *loop = cmd->conn->loop;
+    cmd->next = NULL;
+    if (loop->outbox_tail)
+        loop->outbox_tail->next = cmd;
+    else
+        loop->outbox_head = cmd;
+    loop->outbox_tail = cmd;
+    if (++loop->outbox_len >= HANDBACK || cmd->partial)
+        hand_back(loop);
+}
+
+/* Send responses handed back to thread of loop */
+static void take_responses(web_loop_t *loop)
+{
+    web_cmd_t *cmd = take_over(&loop->done_cmds, loop->wake_fd);
+    while (cmd) {
+        web_cmd_t *next = cmd->next;
+        web_conn_t *conn = cmd->conn;
+        if (cmd->out_len && !conn->done) {
+            struct iovec iov = {cmd->out, cmd->out_len};
+            conn_writev(conn, &iov, 1);
+        }
+        cmd->out_len = 0;
+        if (cmd->partial) {
+            free(cmd->out);
+            free(cmd);
+            conn_flush(conn);
         } else {
-            for (int i = 0; i < length; ++i) {
-                if (filename[i] == '?') {
-                    filename[i] = '\0';
-                    break;
-                }
-            }
+            end_command(cmd);
         }
+        cmd = next;
+    }
+}
+
+/* Rings in shared memory, as described in ring.h.
+ * A ring is set up by the loop serving the connection asking for it, which
+ * passes the descriptors right away, and hands the ring over to the
+ * interpreter along with a duplicate of the socket.  The interpreter serves
+ * it from then on as a connection of its own, with the socket only telling
+ * when the client is gone, and the eventfd of the commands in the same
+ * table of connections.
+ */
+#if defined(__linux__)
+static int ring_memory()
+{
+    int fd = memfd_create("qtest-ring", MFD_CLOEXEC);
+    if (fd >= 0 && ftruncate(fd, sizeof(ring_t)) < 0) {
+        close(fd);
+        fd = -1;
     }
-    url_decode(filename, req->filename, MAXLINE);
+    return fd;
+}
+#else
+static int ring_memory()
+{
+    errno = ENOSYS;
+    return -1;
 }
+#endif
 
-char *web_recv(int fd, struct sockaddr_in *clientaddr)
+/* Answer "ok" on socket, with descriptors of memory and eventfds of ring */
+static bool ring_send(int fd, int mem_fd, web_conn_t *ring)
 {
-    http_request_t req;
-    parse_request(fd, &req);
+    int fds[3] = {mem_fd, ring->submit_fd, ring->results_fd};
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } control;
+    struct iovec iov = {"ok\n", 3};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(c), fds, sizeof(fds));
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) == 3;
+}
 
-    char *p = req.filename;
-    /* Change '/' to ' ' */
-    while (*p) {
-        ++p;
-        if (*p == '/')
-            *p = ' ';
+/* Set up ring for client of connection, which then takes no more requests.
+ * It is answered right away, so only as its first request.
+ */
+static void ring_open(web_conn_t *conn)
+{
+    web_conn_t *ring = NULL;
+    if (!conn->pending && conn->out_sent == conn->out_len)
+        ring = calloc(1, sizeof(web_conn_t));
+    web_cmd_t *cmd = dispatch(conn, ring ? WEB_RING : WEB_ERROR, "", 0);
+    conn->eof = true;
+    if (!ring)
+        return;
+
+    ring->fd = dup(conn->fd);
+    ring->submit_fd = wake_open();
+    ring->results_fd = wake_open();
+    int mem_fd = ring_memory();
+    void *mem = mem_fd < 0 ? MAP_FAILED
+                           : mmap(NULL, sizeof(ring_t), PROT_READ | PROT_WRITE,
+                                  MAP_SHARED, mem_fd, 0);
+    ring->ring = mem != MAP_FAILED ? mem : NULL;
+    bool ok = cmd && ring->fd >= 0 && ring->submit_fd >= 0 &&
+              ring->results_fd >= 0 && ring->ring &&
+              ring_send(conn->fd, mem_fd, ring);
+    if (mem_fd >= 0)
+        close(mem_fd);
+    if (!ok) {
+        if (cmd)
+            cmd->kind = WEB_ERROR;
+        if (ring->fd >= 0)
+            close(ring->fd);
+        ring_free(ring);
+        free(ring);
+        return;
+    }
+    ring->keep_alive = true;
+    cmd->ring = ring;
+}
+
+/* Serve ring from the interpreter */
+static void ring_start(web_conn_t *ring)
+{
+    ring->loop = &main_loop;
+    int fd = ring->fd > ring->submit_fd ? ring->fd : ring->submit_fd;
+    if (!conns_reserve(&main_loop, fd)) {
+        close(ring->fd);
+        ring_free(ring);
+        free(ring);
+        return;
     }
-    char *ret = malloc(strlen(req.filename) + 1);
-    strncpy(ret, req.filename, strlen(req.filename) + 1);
+    main_loop.conns[ring->fd] = main_loop.conns[ring->submit_fd] = ring;
+    if (!event_add(&main_loop, ring->fd, true) ||
+        !event_add(&main_loop, ring->submit_fd, false)) {
+        ring->done = true;
+        conn_release(ring);
+        return;
+    }
+    /* Commands may be there already */
+    ring_take(ring);
+}
 
-    return ret;
+/* Queue commands of ring, until MAXPENDING of them are queued */
+static void ring_take(web_conn_t *conn)
+{
+    ring_index_t *cmds = &conn->ring->cmds;
+    uint64_t head = atomic_load_explicit(&cmds->head, memory_order_relaxed);
+    while (!conn->done && !conn->eof && conn->pending < MAXPENDING) {
+        uint64_t tail = atomic_load_explicit(&cmds->tail, memory_order_acquire);
+        if (head == tail)
+            break;
+        while (head != tail && conn->pending < MAXPENDING) {
+            ring_cmd_t *c = &conn->ring->cmd[head++ % RING_SLOTS];
+            size_t len = c->len < sizeof(c->line) ? c->len : sizeof(c->line);
+            dispatch(conn, WEB_GET, c->line, len);
+        }
+        atomic_store_explicit(&cmds->head, head, memory_order_release);
+        atomic_thread_fence(memory_order_seq_cst);
+    }
 }
 
-int web_eventmux(char *buf)
+/* Put result of command into its ring */
+static void ring_complete(web_cmd_t *cmd)
+{
+    web_conn_t *conn = cmd->conn;
+    if (conn->done)
+        return;
+    ring_index_t *results = &conn->ring->results;
+    uint64_t tail = atomic_load_explicit(&results->tail, memory_order_relaxed);
+    ring_result_t *r = &conn->ring->result[tail % RING_SLOTS];
+    r->ok = run_ok;
+    r->len = resp_total;
+    memcpy(r->out, resp, resp_len);
+    atomic_store_explicit(&results->tail, tail + 1, memory_order_release);
+    if (conn->pending == 1 || ++conn->unsignalled >= RING_SIGNAL) {
+        conn->unsignalled = 0;
+        wake_up(conn->results_fd);
+    }
+}
+
+/* Complete command, queueing its response, and recycle it */
+static void finish_command(web_cmd_t *cmd)
+{
+    if (cmd->conn->ring) {
+        ring_complete(cmd);
+        end_command(cmd);
+        return;
+    }
+    if (n_workers) {
+        send_response(cmd);
+        keep_done(cmd);
+        return;
+    }
+    if (!cmd->conn->done)
+        send_response(cmd);
+    end_command(cmd);
+}
+
+/* Add to output of the running command, sending it as it comes once big */
+static void resp_write(const char *buf, size_t len)
+{
+    resp_total += len;
+    if (running->conn->ring) {
+        /* Only so much is kept in its result */
+        size_t room = RING_OUT - resp_len;
+        buf_append(&resp, &resp_len, &resp_size, buf, len < room ? len : room);
+        return;
+    }
+    buf_append(&resp, &resp_len, &resp_size, buf, len);
+    if (resp_len >= CHUNKSIZE) {
+        /* Send big output as it comes, rather than all of it at the end */
+        if (!n_workers && running->conn->done) {
+            resp_len = 0;
+            return;
+        }
+        resp_chunked = true;
+        send_output(running, false);
+        if (!n_workers)
+            return;
+
+        /* Hand the output over right away, with a copy of the command */
+        web_cmd_t *part = malloc(sizeof(web_cmd_t));
+        if (!part) {
+            running->out_len = 0;
+            return;
+        }
+        *part = *running;
+        part->partial = true;
+        running->out = NULL;
+        running->out_len = running->out_size = 0;
+        keep_done(part);
+    }
+}
+
+void web_send(int out_fd, char *buf)
+{
+    if (!running || out_fd != web_connfd) {
+        writen(out_fd, buf, strlen(buf));
+        return;
+    }
+
+    if (running->format & WEB_JSON)
+        json_string_part(&resp_json, buf, strlen(buf));
+    else
+        resp_write(buf, strlen(buf));
+}
+
+void web_cmd_status(bool ok)
+{
+    if (running)
+        run_ok = ok;
+}
+
+void web_set_state(web_state_t writer)
+{
+    state_writer = writer;
+}
+
+void web_add_metrics(web_metrics_t writer)
+{
+    if (metrics_cnt < MAXMETRICS)
+        metrics_writers[metrics_cnt++] = writer;
+}
+
+void web_metric_help(const char *name, const char *type, const char *help)
+{
+    char line[BUFSIZE];
+    int len = snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n",
+                       name, help, name, type);
+    resp_write(line, len < (int) sizeof(line) ? len : sizeof(line) - 1);
+}
+
+void web_metric(const char *name, const char *labels, double value)
+{
+    char line[BUFSIZE];
+    int len = snprintf(line, sizeof(line), "%s%s%s%s %.15g\n", name,
+                       labels ? "{" : "", labels ? labels : "",
+                       labels ? "}" : "", value);
+    resp_write(line, len < (int) sizeof(line) ? len : sizeof(line) - 1);
+}
+
+/* Write metrics as the response to command */
+static void write_metrics(web_cmd_t *cmd)
 {
-    fd_set listenset;
+    /* Taken as the output of a command, so that it is sent as it comes if
+     * there is much of it
+     */
+    running = cmd;
+    run_ok = true;
+    /* Always in the text format of Prometheus, whatever the query asks */
+    cmd->format &= ~(WEB_JSON | WEB_CONTENTS);
+    start_response(cmd);
+    for (int i = 0; i < metrics_cnt; i++)
+        metrics_writers[i]();
+    running = NULL;
+}
 
-    FD_ZERO(&listenset);
-    FD_SET(STDIN_FILENO, &listenset);
-    int max_fd = STDIN_FILENO;
-    if (server_fd > 0) {
-        FD_SET(server_fd, &listenset);
-        max_fd = max_fd > server_fd ? max_fd : server_fd;
+/* Fail command cut to fit, rather than running what is left of it */
+static void refuse_command(web_cmd_t *cmd)
+{
+    running = cmd;
+    web_connfd = cmd->conn->fd;
+    run_ok = false;
+    run_start = time_ns();
+    start_response(cmd);
+    web_send(web_connfd, "Command too long\n");
+    if (cmd->format & WEB_JSON)
+        end_json(cmd);
+    running = NULL;
+    web_connfd = 0;
+}
+
+/* Answer the empty command, which there is nothing to run for */
+static void skip_command(web_cmd_t *cmd)
+{
+    running = cmd;
+    web_connfd = cmd->conn->fd;
+    run_ok = true;
+    run_start = time_ns();
+    start_response(cmd);
+    if (cmd->format & WEB_JSON)
+        end_json(cmd);
+    running = NULL;
+    web_connfd = 0;
+}
+
+/* Take next command from dispatch queue into buf */
+static int next_command(char *buf)
+{
+    web_cmd_t *cmd = main_loop.queue_head;
+    main_loop.queue_head = cmd->next;
+    if (!main_loop.queue_head)
+        main_loop.queue_tail = NULL;
+
+    if (cmd->kind == WEB_RING) {
+        ring_start(cmd->ring);
+        finish_command(cmd);
+        return 0;
+    }
+
+    /* Nothing to run, or nobody to respond to.  Connections served by
+     * threads are not looked at, commands for closed ones are just run.
+     */
+    if (cmd->kind == WEB_BATCH_END || cmd->kind == WEB_ERROR ||
+        (!n_workers && cmd->conn->done)) {
+        finish_command(cmd);
+        return 0;
+    }
+    if (cmd->kind == WEB_METRICS) {
+        write_metrics(cmd);
+        finish_command(cmd);
+        return 0;
     }
-    int result = select(max_fd + 1, &listenset, NULL, NULL, NULL);
-    if (result < 0)
+    if (cmd->too_long) {
+        refuse_command(cmd);
+        finish_command(cmd);
+        return 0;
+    }
+    if (!*cmd->line) {
+        skip_command(cmd);
+        finish_command(cmd);
+        return 0;
+    }
+
+    strncpy(buf, cmd->line, strlen(cmd->line) + 1);
+    running = cmd;
+    web_connfd = cmd->conn->fd;
+    run_ok = true;
+    run_start = time_ns();
+    start_response(cmd);
+    return strlen(buf);
+}
+
+/* Queue commands handed over by threads */
+static void take_commands()
+{
+    web_cmd_t *list = take_over(&new_cmds, main_loop.wake_fd);
+    if (!list)
+        return;
+    if (main_loop.queue_tail)
+        main_loop.queue_tail->next = list;
+    else
+        main_loop.queue_head = list;
+    while (list->next)
+        list = list->next;
+    main_loop.queue_tail = list;
+}
+
+/* Serve connections of thread, handing commands over as they come */
+static void *worker_run(void *arg)
+{
+    web_loop_t *loop = arg;
+    int fds[MAXEVENTS], flags[MAXEVENTS];
+
+    for (;;) {
+        int n = event_wait(loop, fds, flags, -1);
+        for (int i = 0; i < n; i++) {
+            if (fds[i] == loop->wake_fd)
+                take_responses(loop);
+            else
+                loop_event(loop, fds[i], flags[i]);
+        }
+        if (loop->queue_head) {
+            handover(&new_cmds, main_loop.wake_fd, loop->queue_head);
+            loop->queue_head = loop->queue_tail = NULL;
+        }
+    }
+    return NULL;
+}
+
+static bool loop_init(web_loop_t *loop)
+{
+    memset(loop, 0, sizeof(*loop));
+    loop->listen_fd = loop->wake_fd = -1;
+    return event_init(loop);
+}
+
+/* Open listening socket of loop, at path if any, else on port */
+static bool loop_listen(web_loop_t *loop, int port, const char *path)
+{
+    if (path) {
+        /* Threads take turns on the one socket at path */
+        loop->listen_fd =
+            n_workers ? workers[0].listen_fd : open_listen_unix(path);
+        loop->lines = true;
+    } else {
+        loop->listen_fd = open_listen(port, loop != &main_loop);
+    }
+    return loop->listen_fd >= 0 && event_add(loop, loop->listen_fd, true);
+}
+
+/* Start threads, each with its own listening socket on port, or sharing the
+ * one at path
+ */
+static bool start_workers(int port, const char *path, int threads)
+{
+    workers = calloc(threads, sizeof(web_loop_t));
+    if (!workers)
+        return false;
+
+    /* Signals, such as the alarm of the watchdog, are for the interpreter */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    bool ok = true;
+    while (ok && n_workers < threads) {
+        web_loop_t *loop = &workers[n_workers];
+        ok = loop_init(loop) && loop_listen(loop, port, path) &&
+             (loop->wake_fd = wake_open()) >= 0 &&
+             event_add(loop, loop->wake_fd, false) &&
+             !pthread_create(&loop->thread, NULL, worker_run, loop);
+        if (ok)
+            n_workers++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return ok;
+}
+
+static int web_start(int port, const char *path, int threads)
+{
+    if (!loop_init(&main_loop))
         return -1;
 
-    if (server_fd > 0 && FD_ISSET(server_fd, &listenset)) {
-        FD_CLR(server_fd, &listenset);
-        struct sockaddr_in clientaddr;
-        socklen_t clientlen = sizeof(clientaddr);
-        web_connfd =
-            accept(server_fd, (struct sockaddr *) &clientaddr, &clientlen);
-        char *p = web_recv(web_connfd, &clientaddr);
-        strncpy(buf, p, strlen(p) + 1);
-        send_response(web_connfd);
-        free(p);
-        return strlen(buf);
+    int listenfd;
+    if (threads > 0) {
+        main_loop.wake_fd = wake_open();
+        if (main_loop.wake_fd < 0 ||
+            !event_add(&main_loop, main_loop.wake_fd, false) ||
+            !start_workers(port, path, threads))
+            return -1;
+        listenfd = workers[0].listen_fd;
+    } else {
+        if (!loop_listen(&main_loop, port, path))
+            return -1;
+        listenfd = main_loop.listen_fd;
     }
 
-    FD_CLR(STDIN_FILENO, &listenset);
-    return 0;
+    /* Fails for regular files, which are always readable anyway */
+    stdin_pollable = event_add(&main_loop, STDIN_FILENO, false);
+    stdin_closed = false;
+
+    return listenfd;
+}
+
+int web_open(int port, int threads)
+{
+    return web_start(port, NULL, threads);
+}
+
+int web_open_unix(const char *path, int threads)
+{
+    return web_start(0, path, threads);
+}
+
+void web_close()
+{
+    if (unix_path) {
+        unlink(unix_path);
+        free(unix_path);
+        unix_path = NULL;
+    }
+}
+
+void web_stdin_closed()
+{
+    if (stdin_pollable)
+        event_del(&main_loop, STDIN_FILENO);
+    stdin_pollable = false;
+    stdin_closed = true;
+}
+
+/* Wait until there is input on stdin, returning 0, or a command from a web
+ * client, which is then put into buf, returning its length.  Output of the
+ * command goes to the client, as one response sent once the command is done,
+ * which is when this is called next.
+ */
+int web_eventmux(char *buf)
+{
+    int fds[MAXEVENTS], flags[MAXEVENTS];
+
+    if (running) {
+        if (running->format & WEB_JSON)
+            end_json(running);
+        web_cmd_t *cmd = running;
+        running = NULL;
+        web_connfd = 0;
+        finish_command(cmd);
+    }
+
+    for (;;) {
+        while (main_loop.queue_head) {
+            int len = next_command(buf);
+            if (len)
+                return len;
+        }
+        hand_back_all();
+
+        bool wait = stdin_pollable || stdin_closed;
+        int n = event_wait(&main_loop, fds, flags, wait ? -1 : 0);
+        if (n < 0 && errno != EINTR) /* watchdog expiry may interrupt */
+            return -1;
+        if (n <= 0 && !wait)
+            return 0;
+
+        bool stdin_ready = false;
+        for (int i = 0; i < n; i++) {
+            if (fds[i] == STDIN_FILENO)
+                stdin_ready = true;
+            else if (fds[i] == main_loop.wake_fd)
+                take_commands();
+            else
+                loop_event(&main_loop, fds[i], flags[i]);
+        }
+        /* Commands from clients come first, console input is kept */
+        if (stdin_ready && !main_loop.queue_head)
+            return 0;
+    }
 }
@@ -2,13 +2,52 @@
 #define TINYWEB_H
 
 #include <netinet/in.h>
+#include <stdbool.h>
 
-int web_open(int port);
+#include "json.h"
 
-char *web_recv(int fd, struct sockaddr_in *clientaddr);
+/* Listen on port, with connections served by threads if any, else by the
+ * interpreter while it waits for commands
+ */
+int web_open(int port, int threads);
 
+/* Listen on Unix-domain socket at path instead, for the line protocol of
+ * local clients, or their rings in shared memory, as described in ring.h
+ */
+int web_open_unix(const char *path, int threads);
+
+/* Remove the socket of the Unix-domain server, if any, for the next one.
+ * Connections already made are left open.
+ */
+void web_close();
+
+/* Add output of the running command to the response to its client */
 void web_send(int out_fd, char *buffer);
 
+/* Tell whether the command from a web client succeeded, once it has run */
+void web_cmd_status(bool ok);
+
+/* Function writing state of the queues into a JSON response, with the
+ * contents of the current one if asked for
+ */
+typedef void (*web_state_t)(json_t *j, bool contents);
+
+void web_set_state(web_state_t writer);
+
+/* Function writing metrics for /metrics, in Prometheus text format */
+typedef void (*web_metrics_t)();
+
+void web_add_metrics(web_metrics_t writer);
+
+/* Describe metric, of type counter, gauge or histogram */
+void web_metric_help(const char *name, const char *type, const char *help);
+
+/* Write value of metric, with labels such as cmd="it" unless NULL */
+void web_metric(const char *name, const char *labels, double value);
+
+/* Serve web clients only, once standard input has no more commands */
+void web_stdin_closed();
+
 int web_eventmux(char *buf);
 
 #endif